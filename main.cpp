@@ -7,15 +7,304 @@
 #include <memory>
 #include <array>
 #include <optional>
+#include <span>
+#include <string_view>
+#include <algorithm>
+#include <chrono>
+#include <sstream>
+#include <iomanip>
+#include <cstdint>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <bit>
+#include <functional>
+#include <atomic>
+#include <mutex>
+#include <shared_mutex>
+#include <thread>
+#include <condition_variable>
+#include <map>
+#include <list>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/file.h>
+#include <filesystem>
+#include <sys/wait.h>
+#include <csignal>
+#include <type_traits>
+#include <cstring>
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <sched.h>
+#include <pthread.h>
+#include <linux/mempolicy.h>
 
 constexpr float INF = 1e6;
 constexpr int MAX_RAY_DEPTH = 10;
+constexpr float SHADOW_OFFSET = 1; // shadow rays start this far along the surface normal
 constexpr int WIDTH = 200;
 constexpr int HEIGHT = 200;
 constexpr int resolution = WIDTH * HEIGHT;
 
 using namespace std;
 
+// hot-path instrumentation, selected at compile time with -DRT_INSTRUMENT=1. Disabled, a
+// Scope is an empty object and compiles to nothing. Enabled, each thread records scoped
+// events into its own ring buffer (single writer, no locks once registered) and keeps exact
+// per-stage totals even after the ring wraps; chromeTrace() writes the rings as a
+// Chrome/Perfetto trace once the threads are idle. Constant evaluation records nothing.
+// Enabled builds also count every operator new per thread, totals include the heap
+// allocations made inside each stage.
+#ifndef RT_INSTRUMENT
+#define RT_INSTRUMENT 0
+#endif
+
+using InstrumentTotals = map<string_view, array<uint64_t, 3>>;
+
+template <bool Enabled>
+struct Instrumentation {
+    using Totals = InstrumentTotals;
+
+    struct Scope {
+        constexpr explicit Scope(const char*) {}
+    };
+
+    static constexpr bool enabled = false;
+    static bool chromeTrace(const string &) { return false; }
+    static Totals totals() { return {}; }
+    static void printTotals() {}
+};
+
+template <>
+struct Instrumentation<true> {
+    using Totals = InstrumentTotals;
+    static constexpr bool enabled = true;
+
+    struct Event {
+        const char* name;
+        uint64_t start, duration; // ns since the first event
+    };
+
+    struct Ring {
+        static constexpr size_t CAPACITY = 1 << 18;
+        static constexpr size_t MAX_STAGES = 16;
+
+        unique_ptr<Event[]> events = make_unique_for_overwrite<Event[]>(CAPACITY);
+        atomic<uint64_t> written = 0;
+        unsigned thread = 0;
+        array<const char*, MAX_STAGES> stages{};
+        array<uint64_t, MAX_STAGES> counts{}, nanoseconds{}, allocationCounts{};
+
+        void push(const char* name, uint64_t start, uint64_t end, uint64_t allocated) {
+            uint64_t n = written.load(memory_order_relaxed);
+            events[n & (CAPACITY - 1)] = Event{ name, start, end - start };
+            written.store(n + 1, memory_order_release);
+            // stage names are string literals, compared by address
+            for (size_t s = 0; s < MAX_STAGES; ++s) {
+                if (stages[s] == nullptr) stages[s] = name;
+                if (stages[s] == name) {
+                    counts[s]++, nanoseconds[s] += end - start, allocationCounts[s] += allocated;
+                    break;
+                }
+            }
+        }
+    };
+
+    struct Scope {
+        const char* name;
+        uint64_t start = 0, allocatedBefore = 0;
+
+        constexpr explicit Scope(const char* n) : name(n) {
+            if (!is_constant_evaluated()) start = now(), allocatedBefore = allocations;
+        }
+
+        constexpr ~Scope() {
+            if (!is_constant_evaluated()) {
+                uint64_t end = now(), allocated = allocations - allocatedBefore;
+                local().push(name, start, end, allocated);
+            }
+        }
+    };
+
+    static inline thread_local uint64_t allocations = 0;
+
+    static uint64_t now() {
+        static const auto epoch = chrono::steady_clock::now();
+        return chrono::duration_cast<chrono::nanoseconds>(chrono::steady_clock::now() - epoch).count();
+    }
+
+    static Ring& local() {
+        thread_local Ring* ring = nullptr;
+        if (!ring) {
+            uint64_t allocated = allocations; // registering is not the stage's allocation
+            lock_guard lock(registry);
+            rings.push_back(make_unique<Ring>());
+            ring = rings.back().get();
+            ring->thread = rings.size();
+            allocations = allocated;
+        }
+        return *ring;
+    }
+
+    static bool chromeTrace(const string &fileName) {
+        ofstream outfile(fileName, ios::out | ios::binary);
+        outfile << "{\"traceEvents\":[" << fixed << setprecision(3); // microseconds down to the nanosecond
+        bool first = true;
+        lock_guard lock(registry);
+        for (const auto &ring : rings) {
+            uint64_t n = ring->written.load(memory_order_acquire);
+            for (uint64_t i = n > Ring::CAPACITY ? n - Ring::CAPACITY : 0; i < n; ++i) {
+                const Event &e = ring->events[i & (Ring::CAPACITY - 1)];
+                outfile << (first ? "\n" : ",\n") << "{\"name\":\"" << e.name << "\",\"ph\":\"X\",\"pid\":" << getpid() << ",\"tid\":" << ring->thread
+                        << ",\"ts\":" << e.start / 1000.0 << ",\"dur\":" << e.duration / 1000.0 << "}";
+                first = false;
+            }
+        }
+        outfile << "\n]}\n";
+        return bool(outfile);
+    }
+
+    // per stage: scopes, inclusive ns and heap allocations, summed over the threads
+    static Totals totals() {
+        Totals result;
+        lock_guard lock(registry);
+        for (const auto &ring : rings) {
+            for (size_t s = 0; s < Ring::MAX_STAGES && ring->stages[s]; ++s) {
+                result[ring->stages[s]][0] += ring->counts[s];
+                result[ring->stages[s]][1] += ring->nanoseconds[s];
+                result[ring->stages[s]][2] += ring->allocationCounts[s];
+            }
+        }
+        return result;
+    }
+
+    static void printTotals() {
+        for (const auto &[stage, total] : totals()) {
+            cout << stage << ": " << total[0] << " scopes, " << total[1] / 1e6 << " ms inclusive, " << total[2] << " allocations" << endl;
+        }
+    }
+    static inline mutex registry;
+    static inline vector<unique_ptr<Ring>> rings;
+};
+
+using Instrument = Instrumentation<RT_INSTRUMENT != 0>;
+
+#if RT_INSTRUMENT
+// the whole replaceable set, plain, array, aligned and nothrow, goes through one counted
+// allocation and one release. Both stay out of line so the compiler never pairs an inlined
+// new expression with free().
+[[gnu::noinline]] void* countedAllocate(size_t bytes, size_t alignment) noexcept {
+    Instrument::allocations++;
+    bytes = bytes ? bytes : 1;
+    if (alignment <= __STDCPP_DEFAULT_NEW_ALIGNMENT__) return malloc(bytes);
+    void* memory = nullptr;
+    return posix_memalign(&memory, alignment, bytes) == 0 ? memory : nullptr;
+}
+
+[[gnu::noinline]] void countedRelease(void* memory) noexcept { free(memory); }
+
+void* countedAllocateOrThrow(size_t bytes, size_t alignment) {
+    if (void* memory = countedAllocate(bytes, alignment)) return memory;
+    throw bad_alloc();
+}
+
+void* operator new(size_t bytes) { return countedAllocateOrThrow(bytes, __STDCPP_DEFAULT_NEW_ALIGNMENT__); }
+void* operator new[](size_t bytes) { return countedAllocateOrThrow(bytes, __STDCPP_DEFAULT_NEW_ALIGNMENT__); }
+void* operator new(size_t bytes, align_val_t alignment) { return countedAllocateOrThrow(bytes, size_t(alignment)); }
+void* operator new[](size_t bytes, align_val_t alignment) { return countedAllocateOrThrow(bytes, size_t(alignment)); }
+void* operator new(size_t bytes, const nothrow_t &) noexcept { return countedAllocate(bytes, __STDCPP_DEFAULT_NEW_ALIGNMENT__); }
+void* operator new[](size_t bytes, const nothrow_t &) noexcept { return countedAllocate(bytes, __STDCPP_DEFAULT_NEW_ALIGNMENT__); }
+void* operator new(size_t bytes, align_val_t alignment, const nothrow_t &) noexcept { return countedAllocate(bytes, size_t(alignment)); }
+void* operator new[](size_t bytes, align_val_t alignment, const nothrow_t &) noexcept { return countedAllocate(bytes, size_t(alignment)); }
+
+void operator delete(void* memory) noexcept { countedRelease(memory); }
+void operator delete[](void* memory) noexcept { countedRelease(memory); }
+void operator delete(void* memory, size_t) noexcept { countedRelease(memory); }
+void operator delete[](void* memory, size_t) noexcept { countedRelease(memory); }
+void operator delete(void* memory, align_val_t) noexcept { countedRelease(memory); }
+void operator delete[](void* memory, align_val_t) noexcept { countedRelease(memory); }
+void operator delete(void* memory, size_t, align_val_t) noexcept { countedRelease(memory); }
+void operator delete[](void* memory, size_t, align_val_t) noexcept { countedRelease(memory); }
+void operator delete(void* memory, const nothrow_t &) noexcept { countedRelease(memory); }
+void operator delete[](void* memory, const nothrow_t &) noexcept { countedRelease(memory); }
+void operator delete(void* memory, align_val_t, const nothrow_t &) noexcept { countedRelease(memory); }
+void operator delete[](void* memory, align_val_t, const nothrow_t &) noexcept { countedRelease(memory); }
+#endif
+
+// large buffers (framebuffers, BVH and SoA arrays) on 2 MiB pages. Allocations of at least
+// HUGE_PAGE bytes are mapped directly, 2 MiB aligned and rounded up to whole huge pages, so
+// their length is known again when they are freed; smaller ones use the default allocator.
+// The mode picks how the mapping is backed: System leaves it to the kernel's THP setting,
+// Small forbids huge pages (MADV_NOHUGEPAGE, the 4 KiB baseline), Transparent asks for them
+// (MADV_HUGEPAGE) and Explicit takes reserved hugetlbfs pages, falling back to Transparent
+// when none are left.
+constexpr size_t HUGE_PAGE = 2 << 20;
+
+enum class PageMode { System, Small, Transparent, Explicit };
+
+struct HugePages {
+    static inline atomic<PageMode> mode = PageMode::System;
+    static inline atomic<size_t> explicitBytes = 0, transparentBytes = 0, smallBytes = 0, systemBytes = 0;
+
+    static size_t rounded(size_t bytes) { return (bytes + HUGE_PAGE - 1) / HUGE_PAGE * HUGE_PAGE; }
+
+    static void* map(size_t bytes) {
+        size_t length = rounded(bytes);
+        PageMode chosen = mode;
+        if (chosen == PageMode::Explicit) {
+            void* memory = mmap(nullptr, length, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+            if (memory != MAP_FAILED) {
+                explicitBytes += length;
+                return memory;
+            }
+            chosen = PageMode::Transparent;
+        }
+        // over-map by one huge page and trim both ends to an aligned region
+        char* raw = static_cast<char*>(mmap(nullptr, length + HUGE_PAGE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0));
+        if (raw == MAP_FAILED) throw bad_alloc();
+        char* aligned = reinterpret_cast<char*>((uintptr_t(raw) + HUGE_PAGE - 1) / HUGE_PAGE * HUGE_PAGE);
+        if (aligned > raw) munmap(raw, aligned - raw);
+        munmap(aligned + length, raw + HUGE_PAGE - aligned);
+        if (chosen == PageMode::Transparent) madvise(aligned, length, MADV_HUGEPAGE), transparentBytes += length;
+        else if (chosen == PageMode::Small) madvise(aligned, length, MADV_NOHUGEPAGE), smallBytes += length;
+        else systemBytes += length;
+        return aligned;
+    }
+
+    static void unmap(void* memory, size_t bytes) { munmap(memory, rounded(bytes)); }
+
+    // the granularity a HugePageAllocator buffer of this size can be moved at without splitting pages
+    static size_t pageSize(size_t bytes) { return bytes >= HUGE_PAGE && mode != PageMode::Small ? HUGE_PAGE : size_t(sysconf(_SC_PAGESIZE)); }
+};
+
+template <typename T>
+struct HugePageAllocator {
+    using value_type = T;
+
+    HugePageAllocator() = default;
+    template <typename U>
+    HugePageAllocator(const HugePageAllocator<U> &) {}
+
+    T* allocate(size_t count) {
+        if (count * sizeof(T) < HUGE_PAGE) return allocator<T>().allocate(count);
+        return static_cast<T*>(HugePages::map(count * sizeof(T)));
+    }
+
+    void deallocate(T* items, size_t count) {
+        if (count * sizeof(T) < HUGE_PAGE) allocator<T>().deallocate(items, count);
+        else HugePages::unmap(items, count * sizeof(T));
+    }
+
+    template <typename U>
+    bool operator==(const HugePageAllocator<U> &) const { return true; }
+};
+
+template <typename T>
+using PageVector = vector<T, HugePageAllocator<T>>;
+
 enum Material {
 	Diffuse,
 	Specular,
@@ -40,11 +329,15 @@ struct vec3 {
     constexpr vec3& operator *=(const vec3 &v) { x *= v.x, y *= v.y, z *= v.z; return *this; }
 
     constexpr float dot(const vec3 &v) const { return x * v.x + y * v.y + z * v.z; }
-    constexpr vec3 cross(vec3 &v) { return vec3(y * v.z - z * v.y, z * v.x - x * v.z, x * v.y - y * v.x); }
+    constexpr vec3 cross(const vec3 &v) const { return vec3(y * v.z - z * v.y, z * v.x - x * v.z, x * v.y - y * v.x); }
     constexpr float magnitude() const { return sqrt((x * x) + (y * y) + (z * z)); }
     constexpr vec3& normalize() { double mag = magnitude(); x /= mag, y /= mag, z /= mag; return *this; }
+    constexpr float operator [](int axis) const { return axis == 0 ? x : axis == 1 ? y : z; }
 };
 
+constexpr vec3 vmin(const vec3 &a, const vec3 &b) { return vec3(min(a.x, b.x), min(a.y, b.y), min(a.z, b.z)); }
+constexpr vec3 vmax(const vec3 &a, const vec3 &b) { return vec3(max(a.x, b.x), max(a.y, b.y), max(a.z, b.z)); }
+
 struct Ray {
     vec3 orig;
     vec3 dir;
@@ -66,7 +359,8 @@ struct Intersection {
 	pair<float, float> t;
 	vec3 point;
 	vec3 normal;
-	//Material* material = nullptr;
+	vec3 color;
+	Material material = Diffuse;
 
     constexpr Intersection () {}
 
@@ -76,6 +370,33 @@ struct Intersection {
 };
 
 
+struct AABB {
+    vec3 lo = vec3(INF);
+    vec3 hi = vec3(-INF);
+
+    constexpr void grow(const vec3 &p) { lo = vmin(lo, p), hi = vmax(hi, p); }
+    constexpr void grow(const AABB &box) { lo = vmin(lo, box.lo), hi = vmax(hi, box.hi); }
+
+    constexpr int longestAxis() const {
+        vec3 e = hi - lo;
+        return e.x > e.y && e.x > e.z ? 0 : e.y > e.z ? 1 : 2;
+    }
+
+    // slab test, invDir is precomputed once per ray
+    constexpr bool hit(const Ray &ray, const vec3 &invDir, float tmax) const {
+        float tmin = 0;
+        for (int axis = 0; axis < 3; ++axis) {
+            float t0 = (lo[axis] - ray.orig[axis]) * invDir[axis];
+            float t1 = (hi[axis] - ray.orig[axis]) * invDir[axis];
+            if (t0 > t1) swap(t0, t1);
+            tmin = max(tmin, t0);
+            tmax = min(tmax, t1);
+            if (tmin > tmax) return false;
+        }
+        return true;
+    }
+};
+
 struct Sphere {
     vec3 center;
     float radius;
@@ -91,6 +412,9 @@ struct Sphere {
         return (point + (-center)).normalize(); //check
     }
 
+    constexpr AABB bounds() const { return AABB{ center - radius, center + radius }; }
+    constexpr vec3 centroid() const { return center; }
+
     constexpr optional<Intersection> intersect(const Ray &ray) const {
         vec3 L = center - ray.orig;
         float tca = L.dot(ray.dir);
@@ -110,134 +434,4506 @@ struct Sphere {
     }
 };
 
-constexpr vec3 trace(const Ray &ray, const array<Sphere, 4> &spheres, const array<Light, 1> &lights, const vec3 &background, const int depth) {
-    
-    float tnear = INF;
-    const Sphere* sphere = nullptr;
+struct Triangle {
+    vec3 v0, v1, v2;
+    vec3 color;
+    Material material;
 
-    for (unsigned i = 0; i < spheres.size(); ++i) {
-        if (auto inter = spheres[i].intersect(ray); inter) {
-            
-            if (inter->t.first < 0) inter->t.first = inter->t.second;
-            if (inter->t.first < tnear) {
-                tnear = inter->t.first;
-                sphere = &spheres[i];
+    constexpr Triangle() : color(vec3(0.5, 0.5, 0.5)), material(Diffuse) {}
+
+    constexpr Triangle(const vec3 &a, const vec3 &b, const vec3 &c, const vec3 &col, const Material &mat) :
+              v0(a), v1(b), v2(c), color(col), material(mat) {}
+
+    constexpr vec3 normalAt(const vec3) const {
+        return (v1 - v0).cross(v2 - v0).normalize();
+    }
+
+    constexpr AABB bounds() const { return AABB{ vmin(v0, vmin(v1, v2)), vmax(v0, vmax(v1, v2)) }; }
+    constexpr vec3 centroid() const { return (v0 + v1 + v2) * (1.f / 3.f); }
+
+    // Möller-Trumbore: solve orig + t * dir = v0 + u * e1 + v * e2 by Cramer's rule
+    constexpr optional<Intersection> intersect(const Ray &ray) const {
+        constexpr float EPSILON = 1e-6;
+
+        vec3 e1 = v1 - v0;
+        vec3 e2 = v2 - v0;
+        vec3 p = ray.dir.cross(e2);
+        float det = e1.dot(p);
+
+        if (det > -EPSILON && det < EPSILON) return {}; // ray parallel to the triangle
+
+        float invDet = 1 / det;
+        vec3 s = ray.orig - v0;
+        float u = s.dot(p) * invDet;
+
+        if (u < 0 || u > 1) return {};
+
+        vec3 q = s.cross(e1);
+        float v = ray.dir.dot(q) * invDet;
+
+        if (v < 0 || u + v > 1) return {};
+
+        float t = e2.dot(q) * invDet;
+
+        if (t < EPSILON) return {};
+
+        return Intersection(make_pair(t, t));
+    }
+};
+
+// leaves store [first, first + count) primitives, interior nodes have count == 0,
+// their left child directly follows them and first is the index of the right child
+struct BVHNode {
+    AABB bounds;
+    unsigned first = 0;
+    unsigned count = 0;
+};
+
+constexpr unsigned MAX_LEAF_PRIMITIVES = 2;
+constexpr int BVH_STACK_SIZE = 64;
+
+struct TraversalStats {
+    unsigned long long nodeVisits = 0;
+    unsigned long long triangleTests = 0;
+    unsigned long long sdfSteps = 0;
+    unsigned long long coneTests = 0;
+    unsigned long long coneRejects = 0;
+    unsigned long long shadowConeTests = 0;
+    unsigned long long shadowConeRejects = 0;
+};
+
+template <typename Primitive>
+struct BVHHit {
+    float t;
+    const Primitive* primitive;
+};
+
+using MeshHit = BVHHit<Triangle>;
+
+constexpr vec3 inverseDirection(const vec3 &dir) {
+    // no division by zero in constant expressions, INF is far enough for the slab test
+    return vec3(dir.x != 0 ? 1 / dir.x : INF, dir.y != 0 ? 1 / dir.y : INF, dir.z != 0 ? 1 / dir.z : INF);
+}
+
+template <typename Primitive>
+constexpr unsigned buildBVH(span<Primitive> prims, span<BVHNode> nodes, unsigned &nodeCount, unsigned first, unsigned count,
+                            unsigned maxLeaf = MAX_LEAF_PRIMITIVES) {
+    unsigned index = nodeCount++;
+    AABB centroids;
+
+    for (unsigned i = first; i < first + count; ++i) {
+        nodes[index].bounds.grow(prims[i].bounds());
+        centroids.grow(prims[i].centroid());
+    }
+
+    if (count <= maxLeaf) {
+        nodes[index].first = first;
+        nodes[index].count = count;
+        return index;
+    }
+
+    // median split along the widest spread of centroids
+    int axis = centroids.longestAxis();
+    unsigned mid = first + count / 2;
+    nth_element(prims.begin() + first, prims.begin() + mid, prims.begin() + first + count,
+                [axis](const Primitive &a, const Primitive &b) { return a.centroid()[axis] < b.centroid()[axis]; });
+
+    buildBVH(prims, nodes, nodeCount, first, mid - first, maxLeaf);
+    nodes[index].first = buildBVH(prims, nodes, nodeCount, mid, first + count - mid, maxLeaf);
+    nodes[index].count = 0;
+    return index;
+}
+
+template <bool AnyHit, typename Primitive>
+constexpr optional<BVHHit<Primitive>> traverseBVH(const Ray &ray, span<const Primitive> prims, span<const BVHNode> nodes, float tmax, TraversalStats* stats) {
+    if (nodes.empty()) return {};
+
+    vec3 invDir = inverseDirection(ray.dir);
+    array<unsigned, BVH_STACK_SIZE> stack{};
+    int top = 0;
+    stack[top++] = 0;
+
+    optional<BVHHit<Primitive>> nearest;
+    while (top > 0) {
+        const BVHNode &node = nodes[stack[--top]];
+        if (stats) stats->nodeVisits++;
+        if (!node.bounds.hit(ray, invDir, tmax)) continue;
+
+        if (node.count == 0) {
+            unsigned left = &node - nodes.data() + 1;
+            stack[top++] = node.first;
+            stack[top++] = left;
+            continue;
+        }
+
+        for (unsigned i = node.first; i < node.first + node.count; ++i) {
+            if (stats) stats->triangleTests++;
+            if (auto inter = prims[i].intersect(ray); inter) {
+                float t = inter->t.first < 0 ? inter->t.second : inter->t.first;
+                if (t >= tmax) continue;
+                tmax = t;
+                nearest = BVHHit<Primitive>{ tmax, &prims[i] };
+                if constexpr (AnyHit) return nearest;
             }
         }
     }
+    return nearest;
+}
+
+// compile-time mesh, N is known from the OBJ source (see objTriangleCount)
+template <size_t N>
+struct Mesh {
+    static_assert(N > 0, "a mesh needs at least one triangle");
+
+    array<Triangle, N> triangles;
+    array<BVHNode, 2 * N> nodes;
+    unsigned nodeCount = 0;
+
+    constexpr optional<MeshHit> intersect(const Ray &ray, float tmax = INF, TraversalStats* stats = nullptr) const {
+        return traverseBVH<false>(ray, span<const Triangle>(triangles), span(nodes).first(nodeCount), tmax, stats);
+    }
 
-    //if sphere is null, return bg
-    if (!sphere) {
-        return background; //black backgorund
+    constexpr bool occluded(const Ray &ray, float tmax) const {
+        return traverseBVH<true>(ray, span<const Triangle>(triangles), span(nodes).first(nodeCount), tmax, nullptr).has_value();
     }
+};
 
-    vec3 finalColor = 0;
-    vec3 pointHit = ray.orig + ray.dir * tnear; // point of intersection 
-    vec3 normalHit = pointHit - sphere->center; // normal at intersection point
-    normalHit.normalize(); // normalize normal direction
+// runtime mesh for assets too large to build in the constant evaluator, the
+// storage is shared so copies of a scene (e.g. culled lists) don't duplicate it
+struct RuntimeMesh {
+    struct Storage {
+        PageVector<Triangle> triangles;
+        PageVector<BVHNode> nodes;
+    };
 
+    shared_ptr<const Storage> storage;
+    span<const Triangle> triangles;
+    span<const BVHNode> nodes;
 
-    bool inside = false;
-    if (ray.dir.dot(normalHit) > 0) {
-        normalHit = -normalHit;
-        inside = true;
+    RuntimeMesh() {}
+
+    RuntimeMesh(vector<Triangle> &&tris) {
+        auto built = make_shared<Storage>(Storage{ { tris.begin(), tris.end() }, {} });
+        built->nodes.resize(2 * built->triangles.size());
+        unsigned nodeCount = 0;
+        if (!built->triangles.empty()) buildBVH(span(built->triangles), span(built->nodes), nodeCount, 0, built->triangles.size());
+        built->nodes.resize(nodeCount);
+        share(std::move(built));
     }
 
-	switch (sphere->material) {
+    template <size_t N>
+    RuntimeMesh(const Mesh<N> &mesh) {
+        share(make_shared<Storage>(Storage{ { mesh.triangles.begin(), mesh.triangles.end() },
+                                            { mesh.nodes.begin(), mesh.nodes.begin() + mesh.nodeCount } }));
+    }
 
-		case Diffuse: // DIFFUSE LIGHTING
-		{
-			for (int i = 0; i < lights.size(); ++i) {
-				// this is a light
-				vec3 transmission = 1;
-				vec3 lightDirection = lights[i].position - pointHit;
-				lightDirection.normalize();
-				for (unsigned j = 0; j < spheres.size(); ++j) {
+    // a private copy of the triangles and BVH, allocated in the caller's current page mode
+    // (and on its NUMA node, by first touch)
+    RuntimeMesh relocated() const {
+        RuntimeMesh copy;
+        copy.share(make_shared<Storage>(Storage{ { triangles.begin(), triangles.end() }, { nodes.begin(), nodes.end() } }));
+        return copy;
+    }
 
-					Ray shadowRay = Ray(pointHit + normalHit, lightDirection);
-					if (auto shadow_inter = spheres[j].intersect(shadowRay); shadow_inter) {
-						transmission = 0; //shadowed
-						break;
-					}
-				}
-				finalColor += sphere->color * transmission * max(float(0), normalHit.dot(lightDirection)) * lights[i].color;
-			}
-			break;
-		}
-		default:
-			break;
-	}
+    optional<MeshHit> intersect(const Ray &ray, float tmax = INF, TraversalStats* stats = nullptr) const {
+        return traverseBVH<false>(ray, triangles, nodes, tmax, stats);
+    }
 
-    return finalColor;
+    bool occluded(const Ray &ray, float tmax) const {
+        return traverseBVH<true>(ray, triangles, nodes, tmax, nullptr).has_value();
+    }
+
+private:
+    void share(shared_ptr<const Storage> built) {
+        storage = std::move(built);
+        triangles = storage->triangles;
+        nodes = storage->nodes;
+    }
+};
+
+// OBJ import: only "v" and "f" records matter, faces are fan-triangulated and
+// "v/vt/vn" references keep their vertex index (negative indices are relative)
+
+constexpr bool objSpace(char c) { return c == ' ' || c == '\t' || c == '\r'; }
+
+constexpr string_view objToken(string_view &line) {
+    size_t begin = 0;
+    while (begin < line.size() && objSpace(line[begin])) ++begin;
+    size_t end = begin;
+    while (end < line.size() && !objSpace(line[end])) ++end;
+    string_view token = line.substr(begin, end - begin);
+    line.remove_prefix(end);
+    return token;
 }
 
-void save(string &&fileName, const std::array<std::array<vec3, WIDTH>, HEIGHT> image) {
+constexpr float objFloat(string_view token) {
+    size_t i = 0;
+    float sign = 1;
+    if (i < token.size() && (token[i] == '-' || token[i] == '+')) sign = token[i++] == '-' ? -1 : 1;
 
-    ofstream outfile(fileName, ios::out | ios::binary);
-    
-    outfile << "P3\n" << WIDTH << " " << HEIGHT << "\n" << 255 << "\n";
+    double value = 0;
+    for (; i < token.size() && token[i] >= '0' && token[i] <= '9'; ++i) value = value * 10 + (token[i] - '0');
+    if (i < token.size() && token[i] == '.') {
+        double scale = 0.1;
+        for (++i; i < token.size() && token[i] >= '0' && token[i] <= '9'; ++i, scale *= 0.1) value += (token[i] - '0') * scale;
+    }
+    if (i < token.size() && (token[i] == 'e' || token[i] == 'E')) {
+        ++i;
+        bool negative = i < token.size() && token[i] == '-';
+        if (i < token.size() && (token[i] == '-' || token[i] == '+')) ++i;
+        // past 10^64 a float is already 0 or inf, so clamping keeps the exponent
+        // small and the scaling below takes a handful of squarings
+        int exponent = 0;
+        for (; i < token.size() && token[i] >= '0' && token[i] <= '9'; ++i) exponent = min(exponent * 10 + (token[i] - '0'), 64);
+        double power = 1;
+        for (double base = 10; exponent > 0; exponent >>= 1, base *= base)
+            if (exponent & 1) power *= base;
+        value = negative ? value / power : value * power;
+    }
+    return sign * value;
+}
 
-    for (int i = 0; i < WIDTH; i++) {
-        for (int j = 0; j < HEIGHT; j++) {
-            vec3 color = image[i][j];
+// OBJ indices are 1-based, so 0 (like anything past the vertices read so far) is malformed
+constexpr long objIndex(string_view token, size_t vertexCount, size_t lineNumber) {
+    bool negative = !token.empty() && token[0] == '-';
+    auto bad = [&] { return runtime_error("obj line " + to_string(lineNumber) + ": bad vertex index " + string(token)); };
+    long index = 0;
+    for (size_t i = negative ? 1 : 0; i < token.size() && token[i] != '/'; ++i) {
+        if (token[i] < '0' || token[i] > '9') throw bad();
+        index = index * 10 + (token[i] - '0');
+        // anything past the vertex count is out of range anyway, stop before it overflows
+        if (index > long(vertexCount)) throw bad();
+    }
+    long resolved = negative ? long(vertexCount) - index : index - 1;
+    if (index == 0 || resolved < 0 || resolved >= long(vertexCount)) throw bad();
+    return resolved;
+}
 
-            int red = min(color.x * 255.0, 255.0);
-            int green = min(color.y * 255.0, 255.0);
-            int blue = min(color.z * 255.0, 255.0);
+template <typename Emit>
+constexpr void parseObj(string_view src, const vec3 &offset, float scale, Emit &&emit) {
+    vector<vec3> vertices;
 
-            outfile << red << " " << green << " " << blue << " ";
+    for (size_t lineNumber = 1; !src.empty(); ++lineNumber) {
+        size_t eol = src.find('\n');
+        string_view line = src.substr(0, eol);
+        src.remove_prefix(eol == string_view::npos ? src.size() : eol + 1);
+
+        string_view kind = objToken(line);
+        if (kind == "v") {
+            float x = objFloat(objToken(line));
+            float y = objFloat(objToken(line));
+            float z = objFloat(objToken(line));
+            vertices.push_back(vec3(x, y, z) * scale + offset);
+        } else if (kind == "f") {
+            long first = objIndex(objToken(line), vertices.size(), lineNumber);
+            long prev = objIndex(objToken(line), vertices.size(), lineNumber);
+            for (string_view token = objToken(line); !token.empty(); token = objToken(line)) {
+                long next = objIndex(token, vertices.size(), lineNumber);
+                emit(vertices[first], vertices[prev], vertices[next]);
+                prev = next;
+            }
         }
     }
+}
 
-    outfile <<  "\n"; //footer
-    outfile.close();
+constexpr size_t objTriangleCount(string_view src) {
+    size_t count = 0;
+    parseObj(src, vec3(0), 1, [&](const vec3 &, const vec3 &, const vec3 &) { ++count; });
+    return count;
 }
 
-template <typename Scene, typename Canvas>
-constexpr void render(const Scene& scene, Canvas& canvas, int width, int height) {
-    for (int y = 0; y < height; y++) {
-        for (int x = 0; x < width; x++) {
-            const auto point = get_point(width, height, x, y, scene.get_camera());
-            const auto color = trace_ray({ scene.get_camera().pos, point }, scene, 0);
-            canvas.set_pixel(x, y, color);
+template <size_t N>
+constexpr Mesh<N> loadObj(string_view src, const vec3 &offset, float scale, const vec3 &color, const Material &material) {
+    Mesh<N> mesh{};
+    size_t count = 0;
+    parseObj(src, offset, scale, [&](const vec3 &a, const vec3 &b, const vec3 &c) {
+        mesh.triangles[count++] = Triangle(a, b, c, color, material);
+    });
+    buildBVH(span<Triangle>(mesh.triangles), span<BVHNode>(mesh.nodes), mesh.nodeCount, 0, N);
+    return mesh;
+}
+
+string readFile(const string &fileName) {
+    ifstream infile(fileName, ios::in | ios::binary);
+    if (!infile) throw runtime_error("cannot open " + fileName);
+
+    stringstream buffer;
+    buffer << infile.rdbuf();
+    return buffer.str();
+}
+
+// writes through a temporary file renamed over the target, so readers see the old or the new
+// contents, never a partial file. Returns what failed, empty on success.
+string writeFileAtomically(const filesystem::path &file, string_view bytes) {
+    filesystem::path temporary = file;
+    temporary += ".tmp" + to_string(getpid());
+    ofstream outfile(temporary, ios::out | ios::binary);
+    outfile.write(bytes.data(), bytes.size());
+    outfile.close(); // flushes, a full disk shows up here
+    error_code error;
+    if (outfile) filesystem::rename(temporary, file, error);
+    if (outfile && !error) return "";
+    string failure = outfile ? "cannot rename " + temporary.string() + ": " + error.message() : "cannot write " + temporary.string();
+    filesystem::remove(temporary, error);
+    return failure;
+}
+
+RuntimeMesh buildObjMesh(string_view src, const vec3 &offset, float scale, const vec3 &color, const Material &material) {
+    vector<Triangle> triangles;
+    parseObj(src, offset, scale, [&](const vec3 &a, const vec3 &b, const vec3 &c) {
+        triangles.push_back(Triangle(a, b, c, color, material));
+    });
+    return RuntimeMesh(std::move(triangles));
+}
+
+RuntimeMesh loadObjFile(const string &fileName, const vec3 &offset, float scale, const vec3 &color, const Material &material) {
+    return buildObjMesh(readFile(fileName), offset, scale, color, material);
+}
+
+// signed distance primitives: a small CSG list folded left to right, marched only
+// inside an enclosing sphere whose intersect() is the entry test
+enum SdfShape { SdfSphere, SdfBox, SdfTorus };
+enum SdfOp { SdfUnion, SdfSmoothUnion, SdfSubtract, SdfIntersect };
+
+constexpr int MAX_SDF_NODES = 8;
+constexpr int MAX_SDF_STEPS = 64;
+
+constexpr float fabsf_(float f) { return f < 0 ? -f : f; }
+
+struct SdfNode {
+    SdfShape shape = SdfSphere;
+    SdfOp op = SdfUnion;
+    vec3 center;
+    vec3 size;  // radius in x (sphere), half extents (box), major and minor radius in x and y (torus)
+    float blend = 0; // smoothing radius for SdfSmoothUnion
+
+    constexpr float distance(const vec3 &p) const {
+        vec3 q = p - center;
+        switch (shape) {
+            case SdfBox: {
+                vec3 d = vec3(fabsf_(q.x), fabsf_(q.y), fabsf_(q.z)) - size;
+                return vmax(d, vec3(0)).magnitude() + min(max(d.x, max(d.y, d.z)), 0.f);
+            }
+            case SdfTorus: {
+                float ring = vec3(q.x, 0, q.z).magnitude() - size.x;
+                return vec3(ring, q.y, 0).magnitude() - size.y;
+            }
+            default:
+                return q.magnitude() - size.x;
         }
     }
-}
+};
 
-int main() {
+struct SdfPrimitive {
+    array<SdfNode, MAX_SDF_NODES> nodes{};
+    int nodeCount = 0;
+    Sphere bounds;          // must enclose the surface, carries color and material
+    float lipschitz = 1;    // bound on the gradient length of the folded field
+    float relaxation = 1.6; // over-relaxation factor, 1 is plain sphere tracing
 
-                                                //center, radius, color, material
-    static constexpr array<Sphere, 4> spheres = {Sphere(vec3(0.0, -10004, -20), 10000, vec3(0.20, 0.20, 0.25), Diffuse), 
-                                                 Sphere(vec3(2.0, -2.5, -25), 1.5, vec3(1.0, 0.75, 0.45), Diffuse),
-                                                 Sphere(vec3(-5, -1, -35), 3, vec3(0.75, 0.45, 0.45), Diffuse),
-                                                 Sphere(vec3(5.0, 1, -45), 5, vec3(0.45, 0.45, 0.75), Diffuse)
-    };
-                                                //pos, color, intensity
-    static constexpr array<Light, 1> lights = {Light(vec3(-10.0, 20, -10), vec3(1, 1, 1), 1.0)};
+    constexpr SdfPrimitive() {}
 
-    static constexpr vec3 background = { 0, 0, 0 }; //black background
+    constexpr SdfPrimitive(initializer_list<SdfNode> list, const Sphere &b, float l = 1, float r = 1.6) :
+              nodeCount(list.size()), bounds(b), lipschitz(l), relaxation(r) {
+        copy(list.begin(), list.end(), nodes.begin());
+    }
 
-    static constexpr float invWidth = 1.f / float(WIDTH), invHeight = 1.f / float(HEIGHT);
-    static constexpr float fov = 30;
-    static constexpr float aspectratio = float(WIDTH) / float(HEIGHT);
-    static constexpr float angle = tan(M_PI * 0.5 * fov / 180.);
+    constexpr float distance(const vec3 &p) const {
+        float d = INF;
+        for (int i = 0; i < nodeCount; ++i) {
+            float n = nodes[i].distance(p);
+            switch (nodes[i].op) {
+                case SdfSmoothUnion: {
+                    if (nodes[i].blend <= 0) { // no smoothing radius, a plain union
+                        d = min(d, n);
+                        break;
+                    }
+                    float h = max(nodes[i].blend - fabsf_(d - n), 0.f) / nodes[i].blend;
+                    d = min(d, n) - h * h * nodes[i].blend * 0.25f;
+                    break;
+                }
+                case SdfSubtract: d = max(d, -n); break;
+                case SdfIntersect: d = max(d, n); break;
+                default: d = min(d, n); break;
+            }
+        }
+        return d;
+    }
+
+    constexpr vec3 normalAt(const vec3 &p) const {
+        constexpr float h = 1e-3;
+        return vec3(distance(p + vec3(h, 0, 0)) - distance(p - vec3(h, 0, 0)),
+                    distance(p + vec3(0, h, 0)) - distance(p - vec3(0, h, 0)),
+                    distance(p + vec3(0, 0, h)) - distance(p - vec3(0, 0, h))).normalize();
+    }
+
+    // over-relaxed sphere tracing (Keinert et al.): step omega * d / L and fall back to
+    // a plain step when consecutive unbounding spheres stop overlapping
+    constexpr optional<Intersection> intersect(const Ray &ray, TraversalStats* stats = nullptr) const {
+        constexpr float EPSILON = 1e-3;
 
-    static constexpr std::array<std::array<vec3, WIDTH>, HEIGHT> image = []{
-        array<std::array<vec3, WIDTH>, HEIGHT> canvas{};
+        // a ray starting inside the bounds (a shadow or gather ray leaving the surface) marches
+        // from its origin to the exit; Sphere::intersect misses it when it points away from the center
+        float t = 0, exit = 0;
+        vec3 L = bounds.center - ray.orig;
+        float tca = L.dot(ray.dir), r2 = bounds.radius * bounds.radius;
+        if (L.dot(L) < r2) {
+            exit = tca + sqrt(r2 - (L.dot(L) - tca * tca));
+        } else {
+            auto entry = bounds.intersect(ray);
+            if (!entry) return {};
+            t = max(entry->t.first, 0.f);
+            exit = entry->t.second;
+        }
+        float omega = relaxation;
+        float previousRadius = 0;
+        float stepLength = 0;
 
-        for (unsigned y = 0; y < HEIGHT; ++y) {
-            for (unsigned x = 0; x < WIDTH; ++x) {
-                float xx = (2 * ((x + 0.5) * invWidth) - 1) * angle * aspectratio;
-                float yy = (1 - 2 * ((y + 0.5) * invHeight)) * angle;
+        for (int step = 0; step < MAX_SDF_STEPS && t <= exit; ++step) {
+            if (stats) stats->sdfSteps++;
+            float signedRadius = distance(ray.orig + ray.dir * t) / lipschitz;
+            float radius = fabsf_(signedRadius);
 
-                Ray ray = Ray(vec3(0), vec3(xx, yy, -1).normalize());
-                canvas[y][x] = trace(ray, spheres, lights, background, 0);
+            bool sorFail = omega > 1 && radius + previousRadius < stepLength;
+            if (sorFail) {
+                stepLength -= omega * stepLength;
+                omega = 1;
+            } else {
+                stepLength = signedRadius * omega;
             }
+            previousRadius = radius;
+
+            if (!sorFail && radius < EPSILON) return Intersection(make_pair(t, t));
+            t += stepLength;
         }
+        return {};
+    }
+};
+
+// embedded asset, rendered into the compile-time image
+constexpr string_view octahedronObj = R"(# octahedron
+v  1  0  0
+v -1  0  0
+v  0  1  0
+v  0 -1  0
+v  0  0  1
+v  0  0 -1
+f 1 3 5
+f 3 2 5
+f 2 4 5
+f 4 1 5
+f 3 1 6
+f 2 3 6
+f 4 2 6
+f 1 4 6
+)";
+
+template <typename Spheres, typename Meshes, typename Sdfs, typename Lights>
+struct Scene {
+    Spheres spheres;
+    Meshes meshes;
+    Sdfs sdfs;
+    Lights lights;
+    vec3 background;
+};
+
+// counter-based random numbers: every value is a pure function of its key, so
+// results don't depend on which thread draws them or in which order
+constexpr uint32_t hashRandom(uint32_t x) {
+    x ^= x >> 16;
+    x *= 0x7feb352du;
+    x ^= x >> 15;
+    x *= 0x846ca68bu;
+    x ^= x >> 16;
+    return x;
+}
+
+struct Sampler {
+    uint32_t key;
+    uint32_t dimension = 0;
+
+    constexpr Sampler(uint32_t pixel, uint32_t sample) : key(hashRandom(pixel * 0x9e3779b9u ^ hashRandom(sample))) {}
+
+    constexpr float next() { return (hashRandom(key + dimension++ * 0x68bc21ebu) >> 8) * (1.f / 16777216.f); }
+};
+
+// orthonormal basis around n (Duff et al. 2017)
+constexpr void basis(const vec3 &n, vec3 &t, vec3 &b) {
+    float sign = n.z >= 0 ? 1 : -1;
+    float a = -1 / (sign + n.z);
+    float c = n.x * n.y * a;
+    t = vec3(1 + sign * n.x * n.x * a, sign * c, -sign * n.x);
+    b = vec3(c, sign + n.y * n.y * a, -n.y);
+}
+
+// cosine-weighted direction around n for u1, u2 in [0, 1)
+constexpr vec3 cosineHemisphere(const vec3 &n, float u1, float u2) {
+    vec3 t, b;
+    basis(n, t, b);
+    float r = sqrt(u1), phi = 2 * M_PI * u2;
+    return (t * (r * cos(phi)) + b * (r * sin(phi)) + n * float(sqrt(1 - u1))).normalize();
+}
+
+struct Camera {
+    vec3 position;
+    int width, height;
+    float invWidth, invHeight;
+    float aspectratio;
+    float angle;
+    float aperture = 0;      // thin lens radius, 0 is a pinhole
+    float focusDistance = 1; // distance of the plane in focus
+    vec3 right = vec3(1, 0, 0), up = vec3(0, 1, 0), forward = vec3(0, 0, -1);
+
+    constexpr Camera(const vec3 &pos, int w, int h, float fov) :
+              position(pos), width(w), height(h), invWidth(1.f / float(w)), invHeight(1.f / float(h)),
+              aspectratio(float(w) / float(h)), angle(tan(M_PI * 0.5 * fov / 180.)) {}
+
+    // turns the camera towards target, the default basis looks down -z
+    constexpr Camera& lookAt(const vec3 &target, const vec3 &worldUp = vec3(0, 1, 0)) {
+        forward = (target - position).normalize();
+        right = forward.cross(worldUp).normalize();
+        up = right.cross(forward);
+        return *this;
+    }
+
+    // direction of the image plane point (xx, yy) at unit distance, exact for the default basis
+    constexpr vec3 toWorld(float xx, float yy) const { return right * xx + up * yy + forward; }
+
+    constexpr Ray primaryRay(unsigned x, unsigned y) const {
+        Instrument::Scope scope("ray generation");
+        float xx = (2 * ((x + 0.5) * invWidth) - 1) * angle * aspectratio;
+        float yy = (1 - 2 * ((y + 0.5) * invHeight)) * angle;
+
+        return Ray(position, toWorld(xx, yy).normalize());
+    }
+
+    // thin lens: the ray through image position (px, py) from lens sample (lu, lv) in [0, 1)^2,
+    // aimed at the point the pinhole ray meets on the focus plane
+    constexpr Ray lensRay(float px, float py, float lu, float lv) const {
+        float xx = (2 * (px * invWidth) - 1) * angle * aspectratio;
+        float yy = (1 - 2 * (py * invHeight)) * angle;
+        vec3 focus = position + toWorld(xx, yy) * focusDistance;
+
+        // concentric disk mapping keeps the lens strata compact (Shirley and Chiu)
+        float a = 2 * lu - 1, b = 2 * lv - 1;
+        float r = 0, phi = 0;
+        if (a * a > b * b) r = a, phi = M_PI / 4 * (b / a);
+        else if (b != 0) r = b, phi = M_PI / 2 - M_PI / 4 * (a / b);
+        vec3 lens = position + (right * float(r * cos(phi)) + up * float(r * sin(phi))) * aperture;
+
+        return Ray(lens, (focus - lens).normalize());
+    }
+
+    // blur circle diameter in pixels of a point at the given depth
+    constexpr float circleOfConfusion(float depth) const {
+        float pixelSize = 2 * focusDistance * angle / height; // pixel footprint on the focus plane
+        return 2 * aperture * fabsf_(depth - focusDistance) / depth / pixelSize;
+    }
+
+    // conservative test of a bounding sphere against the four side planes and the image plane
+    constexpr bool inFrustum(const Sphere &bounds) const {
+        vec3 world = bounds.center - position;
+        vec3 q(world.dot(right), world.dot(up), -world.dot(forward));
+        if (q.z > bounds.radius) return false; // behind the camera
+
+        float kx = angle * aspectratio, ky = angle;
+        float rx = bounds.radius * sqrt(1 + kx * kx), ry = bounds.radius * sqrt(1 + ky * ky);
+        return q.x + q.z * kx <= rx && -q.x + q.z * kx <= rx && q.y + q.z * ky <= ry && -q.y + q.z * ky <= ry;
+    }
+};
+
+// angular bounds of a sphere seen from a fixed eye: a ray from the eye can only hit
+// the sphere if its direction lies in the cone, one dot product instead of intersect()
+// cone for a point inside the sphere: paired with a zero axis every direction dots to 0 and passes
+constexpr float ALL_DIRECTIONS = -2;
+
+struct ViewCone {
+    vec3 axis;
+    float cosHalfAngle = ALL_DIRECTIONS; // when the eye is inside the sphere
+};
+
+constexpr ViewCone viewCone(const Sphere &sphere, const vec3 &eye) {
+    constexpr float SLACK = 1e-6; // keeps grazing rays on the intersect() path
+
+    vec3 toCenter = sphere.center - eye;
+    float distance2 = toCenter.dot(toCenter);
+    if (distance2 <= sphere.radius * sphere.radius) return ViewCone{ vec3(0), ALL_DIRECTIONS };
+
+    float sin2 = sphere.radius * sphere.radius / distance2;
+    return ViewCone{ toCenter.normalize(), float(sqrt(1 - sin2)) - SLACK };
+}
+
+template <size_t N>
+constexpr array<ViewCone, N> viewCones(const array<Sphere, N> &spheres, const vec3 &eye) {
+    array<ViewCone, N> cones{};
+    for (size_t i = 0; i < N; ++i) cones[i] = viewCone(spheres[i], eye);
+    return cones;
+}
+
+vector<ViewCone> viewCones(const vector<Sphere> &spheres, const vec3 &eye) {
+    vector<ViewCone> cones;
+    for (const Sphere &sphere : spheres) cones.push_back(viewCone(sphere, eye));
+    return cones;
+}
+
+// light-space cone of a sphere that may occlude a point light: only shading points whose
+// direction from the light lies in the cone and that are farther than the sphere's near
+// side can be shadowed by it. The radius is grown by SHADOW_OFFSET because shadow rays
+// start that far off the line from the shaded point to the light.
+struct OccluderCone {
+    vec3 axis;
+    float cosHalfAngle = ALL_DIRECTIONS; // when the light is inside the grown sphere
+    float nearDistance = 0;
+    unsigned sphere = 0;     // index into the occluder scene's spheres
+};
+
+constexpr OccluderCone occluderCone(const Sphere &sphere, unsigned index, const vec3 &light) {
+    float radius = sphere.radius + SHADOW_OFFSET;
+    vec3 toCenter = sphere.center - light;
+    float distance = toCenter.magnitude();
+    if (distance <= radius) return OccluderCone{ vec3(0), ALL_DIRECTIONS, 0, index };
+
+    float sinHalfAngle = radius / distance;
+    return OccluderCone{ toCenter.normalize(), float(sqrt(1 - sinHalfAngle * sinHalfAngle)), distance - radius, index };
+}
+
+// one row of cones per light
+template <size_t L, size_t S>
+constexpr array<OccluderCone, L * S> occluderCones(const array<Light, L> &lights, const array<Sphere, S> &spheres) {
+    array<OccluderCone, L * S> cones{};
+    for (size_t l = 0; l < L; ++l) {
+        for (size_t s = 0; s < S; ++s) cones[l * S + s] = occluderCone(spheres[s], s, lights[l].position);
+    }
+    return cones;
+}
+
+vector<OccluderCone> occluderCones(const vector<Light> &lights, const vector<Sphere> &spheres) {
+    vector<OccluderCone> cones;
+    for (const Light &light : lights) {
+        for (unsigned s = 0; s < spheres.size(); ++s) cones.push_back(occluderCone(spheres[s], s, light.position));
+    }
+    return cones;
+}
+
+// irradiance caching (Ward et al. 1988) for one bounce of indirect diffuse light:
+// records are computed sparsely with a stratified hemisphere gather and interpolated
+// wherever their error estimate stays below the accuracy setting. Records only
+// depend on lights and geometry, so a cache can be saved and reused for other frames.
+constexpr float SECONDARY_OFFSET = 0.01; // indirect rays start this far along the normal
+
+struct IrradianceSettings {
+    int samples = 64;       // hemisphere rays per record
+    float accuracy = 0.3;   // Ward's a, larger reuses records further away
+    float minSpacing = 0.2; // clamps on a record's harmonic mean distance
+    float maxSpacing = 8;
+};
+
+struct GatherSample {
+    vec3 radiance;
+    float distance = INF; // to the surface hit, INF on a miss
+};
+
+struct IrradianceRecord {
+    vec3 position;
+    vec3 normal;
+    vec3 irradiance; // E / pi, so a Lambertian surface reflects albedo * irradiance
+    float radius;    // harmonic mean distance to the surfaces seen from the record
+};
+
+class IrradianceCache {
+public:
+    using Gather = function<GatherSample(const Ray&)>;
+
+    IrradianceCache(const AABB &bounds, const IrradianceSettings &s, uint64_t hash, Gather g) :
+                    settings(s), sceneHash(hash), gather(std::move(g)) {
+        vec3 extent = bounds.hi - bounds.lo;
+        nodes.push_back(Node{ (bounds.lo + bounds.hi) * 0.5f, max(extent.x, max(extent.y, extent.z)) * 0.5f + 1 });
+    }
+
+    vec3 irradiance(const vec3 &p, const vec3 &n) {
+        {
+            shared_lock lock(mutex);
+            vec3 sum;
+            float weights = 0;
+            for (int node = 0; node >= 0; node = nodes[node].children[octant(nodes[node], p)]) {
+                for (unsigned r : nodes[node].records) {
+                    float w = weight(records[r], p, n);
+                    if (w > 1 / settings.accuracy) sum += records[r].irradiance * w, weights += w;
+                }
+            }
+            if (weights > 0) {
+                hits++;
+                return sum * (1 / weights);
+            }
+        }
+
+        misses++;
+        IrradianceRecord record = compute(p, n);
+        if (frozen) return record.irradiance;
+        unique_lock lock(mutex);
+        insert(record);
+        return record.irradiance;
+    }
+
+    size_t size() const { return records.size(); }
+
+    // stops inserting records, lookups no longer depend on the order of earlier lookups
+    void freeze() { frozen = true; }
+
+    bool save(const string &fileName) const {
+        ofstream outfile(fileName, ios::out | ios::binary);
+        size_t count = records.size();
+        outfile.write(reinterpret_cast<const char*>(&sceneHash), sizeof(sceneHash));
+        outfile.write(reinterpret_cast<const char*>(&count), sizeof(count));
+        outfile.write(reinterpret_cast<const char*>(records.data()), count * sizeof(IrradianceRecord));
+        return bool(outfile);
+    }
+
+    // only records computed for the same lights and geometry are loaded, and no more
+    // of them than the file can hold
+    bool load(const string &fileName) {
+        ifstream infile(fileName, ios::in | ios::binary | ios::ate);
+        uint64_t hash = 0;
+        size_t count = 0;
+        size_t bytes = infile ? size_t(infile.tellg()) : 0;
+        infile.seekg(0);
+        if (!infile.read(reinterpret_cast<char*>(&hash), sizeof(hash)) || hash != sceneHash) return false;
+        if (!infile.read(reinterpret_cast<char*>(&count), sizeof(count))) return false;
+        if (count > (bytes - sizeof(hash) - sizeof(count)) / sizeof(IrradianceRecord)) return false;
+        vector<IrradianceRecord> loaded(count);
+        if (!infile.read(reinterpret_cast<char*>(loaded.data()), count * sizeof(IrradianceRecord))) return false;
+        for (const IrradianceRecord &record : loaded) insert(record);
+        return true;
+    }
+
+    atomic<size_t> hits = 0;
+    atomic<size_t> misses = 0;
+
+private:
+    struct Node {
+        vec3 center;
+        float halfSize;
+        array<int, 8> children = { -1, -1, -1, -1, -1, -1, -1, -1 };
+        vector<unsigned> records = {};
+    };
+
+    static int octant(const Node &node, const vec3 &p) {
+        return (p.x > node.center.x) | (p.y > node.center.y) << 1 | (p.z > node.center.z) << 2;
+    }
+
+    float weight(const IrradianceRecord &record, const vec3 &p, const vec3 &n) const {
+        vec3 d = p - record.position;
+        if (d.dot(n + record.normal) < -0.05f * record.radius) return 0; // record lies in front of p
+        float error = d.magnitude() / record.radius + sqrt(max(0.f, 1 - n.dot(record.normal)));
+        return 1 / max(error, 1e-6f);
+    }
+
+    IrradianceRecord compute(const vec3 &p, const vec3 &n) const {
+        Sampler sampler(hashRandom(bit_cast<uint32_t>(p.x)) ^ hashRandom(bit_cast<uint32_t>(p.y) + 1), bit_cast<uint32_t>(p.z));
+        int strata = max(1, int(sqrt(settings.samples)));
+        vec3 sum;
+        float inverseDistances = 0;
+
+        for (int i = 0; i < strata; ++i) {
+            for (int j = 0; j < strata; ++j) {
+                vec3 dir = cosineHemisphere(n, (i + sampler.next()) / strata, (j + sampler.next()) / strata);
+                GatherSample sample = gather(Ray(p + n * SECONDARY_OFFSET, dir));
+                sum += sample.radiance;
+                inverseDistances += 1 / sample.distance;
+            }
+        }
+
+        float count = strata * strata;
+        float radius = count / inverseDistances;
+        return IrradianceRecord{ p, n, sum * (1 / count), clamp(radius, settings.minSpacing, settings.maxSpacing) };
+    }
+
+    void insert(const IrradianceRecord &record) {
+        unsigned index = records.size();
+        records.push_back(record);
+        float influence = settings.accuracy * record.radius;
+        if (!overlaps(nodes[0], record.position, influence)) nodes[0].records.push_back(index);
+        else insert(index, 0, influence);
+    }
+
+    // stored in every node of the finest level still larger than the record's influence
+    void insert(unsigned record, int node, float influence) {
+        if (nodes[node].halfSize * 0.5f < influence) {
+            nodes[node].records.push_back(record);
+            return;
+        }
+        for (int c = 0; c < 8; ++c) {
+            float h = nodes[node].halfSize * 0.5f;
+            vec3 center = nodes[node].center + vec3(c & 1 ? h : -h, c & 2 ? h : -h, c & 4 ? h : -h);
+            if (!overlaps(Node{ center, h }, records[record].position, influence)) continue;
+            if (nodes[node].children[c] < 0) {
+                nodes[node].children[c] = nodes.size();
+                nodes.push_back(Node{ center, h });
+            }
+            insert(record, nodes[node].children[c], influence);
+        }
+    }
+
+    static bool overlaps(const Node &node, const vec3 &p, float radius) {
+        vec3 d = vmax(vec3(0), vmax(node.center - vec3(node.halfSize) - p, p - node.center - vec3(node.halfSize)));
+        return d.dot(d) <= radius * radius;
+    }
+
+    IrradianceSettings settings;
+    uint64_t sceneHash;
+    atomic<bool> frozen = false;
+    Gather gather;
+    vector<IrradianceRecord> records;
+    vector<Node> nodes;
+    mutable shared_mutex mutex;
+};
+
+// approximate shadows for previews: a cube map per point light holding the distance
+// to the nearest occluder, filtered with a (2 * pcfRadius + 1)^2 percentage-closer kernel
+struct ShadowMapSettings {
+    int resolution = 256; // texels along a cube face edge
+    float bias = 0.1;     // depth bias in scene units, against acne
+    int pcfRadius = 1;
+};
+
+struct ShadowMap {
+    vec3 light;
+    ShadowMapSettings settings;
+    vector<float> depth; // 6 faces of resolution^2 texels
+
+    // face 2 * axis + (direction is negative), u and v run along the two other axes in order
+    static constexpr vec3 direction(int face, float u, float v) {
+        int axis = face / 2;
+        array<float, 3> d{};
+        d[axis] = face % 2 ? -1 : 1;
+        d[(axis + 1) % 3] = u;
+        d[(axis + 2) % 3] = v;
+        return vec3(d[0], d[1], d[2]).normalize();
+    }
+
+    constexpr float visibility(const vec3 &point) const {
+        vec3 d = point - light;
+        vec3 a = vec3(fabsf_(d.x), fabsf_(d.y), fabsf_(d.z));
+        int axis = a.x >= a.y && a.x >= a.z ? 0 : a.y >= a.z ? 1 : 2;
+        int face = 2 * axis + (d[axis] < 0);
+        int res = settings.resolution;
+        int tu = clamp(int((d[(axis + 1) % 3] / a[axis] * 0.5f + 0.5f) * res), 0, res - 1);
+        int tv = clamp(int((d[(axis + 2) % 3] / a[axis] * 0.5f + 0.5f) * res), 0, res - 1);
+
+        float distance = d.magnitude() - settings.bias;
+        int lit = 0, taps = 0;
+        for (int dv = -settings.pcfRadius; dv <= settings.pcfRadius; ++dv) {
+            for (int du = -settings.pcfRadius; du <= settings.pcfRadius; ++du, ++taps) {
+                int x = clamp(tu + du, 0, res - 1), y = clamp(tv + dv, 0, res - 1);
+                lit += distance <= depth[(size_t(face) * res + y) * res + x];
+            }
+        }
+        return float(lit) / taps;
+    }
+};
+
+// per-frame data shared by every trace() call of a frame
+struct FrameContext {
+    span<const ViewCone> viewCones = {};         // parallel to the primary scene's spheres, empty to test them all
+    span<const OccluderCone> occluderCones = {}; // lights x occluder spheres, empty to test them all
+    span<const ShadowMap> shadowMaps = {};       // one per light, replaces shadow rays when present
+    IrradianceCache* irradiance = nullptr;       // adds one bounce of indirect diffuse light to primary hits
+    TraversalStats* stats = nullptr;
+};
+
+template <typename Scene>
+constexpr optional<Intersection> nearestHit(const Ray &ray, const Scene &scene, span<const ViewCone> cones = {}, TraversalStats* stats = nullptr) {
+    Instrument::Scope scope("nearest hit");
+
+    float tnear = INF;
+    const Sphere* sphere = nullptr;
+    const Triangle* triangle = nullptr;
+    const SdfPrimitive* sdf = nullptr;
+
+    for (unsigned i = 0; i < scene.spheres.size(); ++i) {
+        if (!cones.empty()) {
+            if (stats) stats->coneTests++;
+            if (ray.dir.dot(cones[i].axis) < cones[i].cosHalfAngle) {
+                if (stats) stats->coneRejects++;
+                continue;
+            }
+        }
+
+        if (auto inter = scene.spheres[i].intersect(ray); inter) {
+            
+            if (inter->t.first < 0) inter->t.first = inter->t.second;
+            if (inter->t.first < tnear) {
+                tnear = inter->t.first;
+                sphere = &scene.spheres[i];
+            }
+        }
+    }
+
+    for (const auto &mesh : scene.meshes) {
+        if (auto inter = mesh.intersect(ray, tnear); inter) {
+            tnear = inter->t;
+            triangle = inter->primitive;
+            sphere = nullptr;
+        }
+    }
+
+    for (const auto &candidate : scene.sdfs) {
+        if (auto inter = candidate.intersect(ray); inter && inter->t.first < tnear) {
+            tnear = inter->t.first;
+            sdf = &candidate;
+            sphere = nullptr;
+            triangle = nullptr;
+        }
+    }
+
+    if (!sphere && !triangle && !sdf) return {};
+
+    Intersection hit(make_pair(tnear, tnear));
+    hit.point = ray.orig + ray.dir * tnear; // point of intersection
+    if (sphere) {
+        hit.normal = hit.point - sphere->center; // normal at intersection point
+        hit.normal.normalize(); // normalize normal direction
+        hit.color = sphere->color;
+        hit.material = sphere->material;
+    } else if (triangle) {
+        hit.normal = triangle->normalAt(hit.point);
+        hit.color = triangle->color;
+        hit.material = triangle->material;
+    } else {
+        hit.normal = sdf->normalAt(hit.point);
+        hit.color = sdf->bounds.color;
+        hit.material = sdf->bounds.material;
+    }
+    return hit;
+}
+
+// any-hit query for shadow rays, stops at the first occluder closer than tmax.
+// With occluder cones for the ray's light, only spheres whose cone contains the
+// shaded point (the ray runs from it toward the light) get the full intersection.
+template <typename Scene>
+constexpr bool occluded(const Ray &ray, const Scene &scene, float tmax, span<const OccluderCone> cones = {}, TraversalStats* stats = nullptr) {
+    if (cones.empty()) {
+        for (unsigned j = 0; j < scene.spheres.size(); ++j) {
+            if (auto inter = scene.spheres[j].intersect(ray); inter && inter->t.first < tmax) return true;
+        }
+    }
+    for (const OccluderCone &cone : cones) {
+        if (stats) stats->shadowConeTests++;
+        if (cone.nearDistance > tmax || -ray.dir.dot(cone.axis) < cone.cosHalfAngle) {
+            if (stats) stats->shadowConeRejects++;
+            continue;
+        }
+        if (auto inter = scene.spheres[cone.sphere].intersect(ray); inter && inter->t.first < tmax) return true;
+    }
+    for (const auto &mesh : scene.meshes) {
+        if (mesh.occluded(ray, tmax)) return true;
+    }
+    for (const auto &sdf : scene.sdfs) {
+        if (auto inter = sdf.intersect(ray); inter && inter->t.first < tmax) return true;
+    }
+    return false;
+}
+
+template <typename Scene, typename Occluders>
+constexpr vec3 shade(const Ray &ray, const Intersection *hit, const Scene &scene, const Occluders &occluders, const FrameContext &frame, const int depth) {
+    Instrument::Scope scope("shading");
+
+    vec3 finalColor = 0;
+    vec3 pointHit = hit->point;
+    vec3 normalHit = hit->normal;
+
+    bool inside = false;
+    if (ray.dir.dot(normalHit) > 0) {
+        normalHit = -normalHit;
+        inside = true;
+    }
+
+	switch (hit->material) {
+
+		case Diffuse: // DIFFUSE LIGHTING
+		{
+			size_t conesPerLight = scene.lights.empty() ? 0 : frame.occluderCones.size() / scene.lights.size();
+			for (size_t i = 0; i < scene.lights.size(); ++i) {
+				const Light &light = scene.lights[i]; // this is a light
+				vec3 transmission = 1;
+				vec3 lightDirection = light.position - pointHit;
+				float lightDistance = lightDirection.magnitude();
+				lightDirection.normalize();
+
+				Ray shadowRay = Ray(pointHit + normalHit * SHADOW_OFFSET, lightDirection);
+				Instrument::Scope shadows("shadows");
+				if (!frame.shadowMaps.empty()) {
+					transmission = frame.shadowMaps[i].visibility(shadowRay.orig);
+				} else if (occluded(shadowRay, occluders, lightDistance, frame.occluderCones.subspan(i * conesPerLight, conesPerLight), frame.stats)) {
+					transmission = 0; //shadowed
+				}
+				finalColor += hit->color * transmission * max(float(0), normalHit.dot(lightDirection)) * light.color;
+			}
+			if (frame.irradiance && depth == 0) {
+				finalColor += hit->color * frame.irradiance->irradiance(pointHit, normalHit);
+			}
+			break;
+		}
+		default:
+			break;
+	}
+
+    return finalColor;
+}
+
+// scene answers nearest-hit queries, occluders shadow queries (the same scene unless culled per ray type)
+template <typename Scene, typename Occluders>
+constexpr vec3 trace(const Ray &ray, const Scene &scene, const Occluders &occluders, const FrameContext &frame, const int depth) {
+
+    // the view cones only bound rays leaving the eye
+    auto hit = nearestHit(ray, scene, depth == 0 ? frame.viewCones : span<const ViewCone>(), frame.stats);
+
+    //if nothing was hit, return bg
+    if (!hit) {
+        return scene.background; //black backgorund
+    }
+
+    return shade(ray, &*hit, scene, occluders, frame, depth);
+}
+
+template <typename Scene>
+constexpr vec3 trace(const Ray &ray, const Scene &scene, const int depth) {
+    return trace(ray, scene, scene, FrameContext{}, depth);
+}
+
+template <int W, int H>
+struct FixedCanvas {
+    static constexpr int width = W;
+    static constexpr int height = H;
+    array<array<vec3, W>, H> pixels{};
+
+    constexpr void set_pixel(int x, int y, const vec3 &color) { pixels[y][x] = color; }
+    constexpr const vec3& get_pixel(int x, int y) const { return pixels[y][x]; }
+};
+
+struct Canvas {
+    int width, height;
+    PageVector<vec3> pixels;
+
+    Canvas(int w, int h) : width(w), height(h), pixels(size_t(w) * h) {}
+
+    void set_pixel(int x, int y, const vec3 &color) { pixels[size_t(y) * width + x] = color; }
+    const vec3& get_pixel(int x, int y) const { return pixels[size_t(y) * width + x]; }
+};
+
+template <typename Canvas>
+void save(string &&fileName, const Canvas &image) {
+    Instrument::Scope scope("write");
+
+    ofstream outfile(fileName, ios::out | ios::binary);
+    
+    outfile << "P3\n" << image.width << " " << image.height << "\n" << 255 << "\n";
+
+    for (int y = 0; y < image.height; y++) {
+        for (int x = 0; x < image.width; x++) {
+            vec3 color = image.get_pixel(x, y);
+
+            int red = min(color.x * 255.0, 255.0);
+            int green = min(color.y * 255.0, 255.0);
+            int blue = min(color.z * 255.0, 255.0);
+
+            outfile << red << " " << green << " " << blue << " ";
+        }
+    }
+
+    outfile <<  "\n"; //footer
+    outfile.close();
+}
+
+// binary PPM with the same quantization as save()
+string encodeP6(const Canvas &image) {
+    Instrument::Scope scope("encode");
+    string out = "P6\n" + to_string(image.width) + " " + to_string(image.height) + "\n255\n";
+    for (const vec3 &color : image.pixels) {
+        for (int c = 0; c < 3; ++c) out += char(int(min(color[c] * 255.0, 255.0)));
+    }
+    return out;
+}
+
+// an encoded image, a failed write ends the run with an error
+void writeImage(const string &fileName, const string &encoded) {
+    Instrument::Scope scope("write");
+    ofstream outfile(fileName, ios::out | ios::binary);
+    outfile << encoded;
+    outfile.close();
+    if (!outfile) throw runtime_error("cannot write " + fileName);
+}
+
+template <typename Scene, typename Occluders, typename Canvas>
+constexpr void render(const Scene& scene, const Occluders& occluders, const FrameContext& frame, const Camera& camera, Canvas& canvas) {
+    for (int y = 0; y < camera.height; y++) {
+        for (int x = 0; x < camera.width; x++) {
+            canvas.set_pixel(x, y, trace(camera.primaryRay(x, y), scene, occluders, frame, 0));
+        }
+    }
+}
+
+template <typename Scene, typename Canvas>
+constexpr void render(const Scene& scene, const Camera& camera, Canvas& canvas) {
+    render(scene, scene, FrameContext{}, camera, canvas);
+}
+
+using RuntimeScene = Scene<vector<Sphere>, vector<RuntimeMesh>, vector<SdfPrimitive>, vector<Light>>;
+
+// compile-time scene preprocessing: primitives are classified by the ray types that
+// can reach them, so each intersection loop only iterates what can matter to it
+enum RayType : unsigned { PrimaryRays = 1, ShadowRays = 2 };
+
+constexpr Sphere boundingSphere(const Sphere &sphere) { return sphere; }
+constexpr Sphere boundingSphere(const SdfPrimitive &sdf) { return sdf.bounds; }
+
+constexpr Sphere boundingSphere(span<const BVHNode> nodes) {
+    if (nodes.empty()) return Sphere();
+    const AABB &box = nodes[0].bounds;
+    return Sphere((box.lo + box.hi) * 0.5f, (box.hi - box.lo).magnitude() * 0.5f, vec3(0), Diffuse);
+}
+
+template <size_t N>
+constexpr Sphere boundingSphere(const Mesh<N> &mesh) { return boundingSphere(span(mesh.nodes).first(mesh.nodeCount)); }
+Sphere boundingSphere(const RuntimeMesh &mesh) { return boundingSphere(mesh.nodes); }
+
+// can a primitive bounded by s block a segment from the light to a point inside v?
+// both spheres are seen from the light as cones, the segments to v fill v's cone
+// and stop at v's far side
+constexpr bool canShadow(const Sphere &s, const Sphere &v, const vec3 &light) {
+    vec3 toS = s.center - light;
+    vec3 toV = v.center - light;
+    float ds = toS.magnitude();
+    float dv = toV.magnitude();
+
+    if (ds <= s.radius || dv <= v.radius) return true; // light inside one of them
+    if (ds - s.radius > dv + v.radius) return false;   // entirely beyond v
+
+    // angle between the cone axes must not exceed the sum of the half angles
+    float sinS = s.radius / ds, sinV = v.radius / dv;
+    float cosS = sqrt(1 - sinS * sinS), cosV = sqrt(1 - sinV * sinV);
+    if (cosS * cosV - sinS * sinV <= 0) return true; // half angles sum past 90 degrees
+    return toS.dot(toV) / (ds * dv) >= cosS * cosV - sinS * sinV;
+}
+
+// one RayType mask per primitive, ordered spheres, meshes, sdfs; with several cameras a
+// primitive keeps a ray type if any of the views needs it
+template <typename Scene>
+constexpr vector<unsigned> classify(const Scene &scene, span<const Camera> cameras) {
+    vector<Sphere> bounds;
+    for (const auto &s : scene.spheres) bounds.push_back(boundingSphere(s));
+    for (const auto &m : scene.meshes) bounds.push_back(boundingSphere(m));
+    for (const auto &s : scene.sdfs) bounds.push_back(boundingSphere(s));
+
+    vector<unsigned> masks(bounds.size(), 0);
+    for (size_t i = 0; i < bounds.size(); ++i) {
+        for (const Camera &camera : cameras) {
+            if (camera.inFrustum(bounds[i])) masks[i] |= PrimaryRays;
+        }
+    }
+
+    // shadow rays start up to SHADOW_OFFSET away from the visible surface
+    for (size_t i = 0; i < bounds.size(); ++i) {
+        for (size_t v = 0; v < bounds.size() && !(masks[i] & ShadowRays); ++v) {
+            if (!(masks[v] & PrimaryRays)) continue;
+            Sphere receiver = bounds[v];
+            receiver.radius += SHADOW_OFFSET;
+            for (const Light &light : scene.lights) {
+                if (canShadow(bounds[i], receiver, light.position)) {
+                    masks[i] |= ShadowRays;
+                    break;
+                }
+            }
+        }
+    }
+    return masks;
+}
+
+struct CullCounts {
+    size_t spheres = 0;
+    size_t meshes = 0;
+    size_t sdfs = 0;
+};
+
+template <typename Scene>
+constexpr CullCounts cullCounts(const Scene &scene, const Camera &camera, RayType type) {
+    vector<unsigned> masks = classify(scene, span<const Camera>(&camera, 1));
+    CullCounts counts;
+    size_t i = 0;
+    for (size_t s = 0; s < scene.spheres.size(); ++s) counts.spheres += (masks[i++] & type) != 0;
+    for (size_t m = 0; m < scene.meshes.size(); ++m) counts.meshes += (masks[i++] & type) != 0;
+    for (size_t s = 0; s < scene.sdfs.size(); ++s) counts.sdfs += (masks[i++] & type) != 0;
+    return counts;
+}
+
+template <typename Culled, typename Scene>
+constexpr void cullInto(Culled &culled, const Scene &scene, span<const Camera> cameras, RayType type, auto &&append) {
+    vector<unsigned> masks = classify(scene, cameras);
+    size_t i = 0;
+    for (const auto &s : scene.spheres) if (masks[i++] & type) append(culled.spheres, s);
+    for (const auto &m : scene.meshes) if (masks[i++] & type) append(culled.meshes, m);
+    for (const auto &s : scene.sdfs) if (masks[i++] & type) append(culled.sdfs, s);
+}
+
+// Counts must be cullCounts(scene, camera, type)
+template <CullCounts Counts, typename Scene>
+constexpr auto cullScene(const Scene &scene, const Camera &camera, RayType type) {
+    using MeshType = typename decltype(scene.meshes)::value_type;
+    ::Scene<array<Sphere, Counts.spheres>, array<MeshType, Counts.meshes>, array<SdfPrimitive, Counts.sdfs>, decltype(scene.lights)> culled{
+        {}, {}, {}, scene.lights, scene.background
+    };
+    size_t sizes[3] = {};
+    cullInto(culled, scene, span<const Camera>(&camera, 1), type, [&](auto &list, const auto &primitive) {
+        using T = remove_cvref_t<decltype(primitive)>;
+        size_t &n = sizes[is_same_v<T, Sphere> ? 0 : is_same_v<T, SdfPrimitive> ? 2 : 1];
+        list[n++] = primitive;
+    });
+    return culled;
+}
+
+RuntimeScene cullScene(const RuntimeScene &scene, span<const Camera> cameras, RayType type) {
+    RuntimeScene culled{ {}, {}, {}, scene.lights, scene.background };
+    cullInto(culled, scene, cameras, type, [](auto &list, const auto &primitive) { list.push_back(primitive); });
+    return culled;
+}
+
+RuntimeScene cullScene(const RuntimeScene &scene, const Camera &camera, RayType type) { return cullScene(scene, span<const Camera>(&camera, 1), type); }
+
+template <typename Scene>
+RuntimeScene toRuntime(const Scene &scene) {
+    RuntimeScene runtime{ { scene.spheres.begin(), scene.spheres.end() }, {}, { scene.sdfs.begin(), scene.sdfs.end() },
+                          { scene.lights.begin(), scene.lights.end() }, scene.background };
+    for (const auto &mesh : scene.meshes) runtime.meshes.push_back(RuntimeMesh(mesh));
+    return runtime;
+}
+
+// FNV-1a over every field of every primitive and light, identifies a scene's content.
+// Structs go in field by field so their padding never reaches the hash.
+struct ContentHash {
+    uint64_t value = 0xcbf29ce484222325ull;
+
+    ContentHash& add(const void* data, size_t bytes) {
+        for (size_t i = 0; i < bytes; ++i) value = (value ^ static_cast<const unsigned char*>(data)[i]) * 0x100000001b3ull;
+        return *this;
+    }
+
+    template <typename T> requires is_arithmetic_v<T> || is_enum_v<T>
+    ContentHash& field(T value) { return add(&value, sizeof(value)); }
+    ContentHash& field(const vec3 &v) { return field(v.x).field(v.y).field(v.z); }
+    ContentHash& field(const Sphere &s) { return field(s.center).field(s.radius).field(s.color).field(s.material); }
+    ContentHash& field(const Triangle &t) { return field(t.v0).field(t.v1).field(t.v2).field(t.color).field(t.material); }
+    ContentHash& field(const Light &l) { return field(l.position).field(l.color).field(l.intensity); }
+    ContentHash& field(const SdfNode &n) { return field(n.shape).field(n.op).field(n.center).field(n.size).field(n.blend); }
+
+    // the derived invWidth, invHeight and aspectratio follow from width and height
+    ContentHash& field(const Camera &c) {
+        return field(c.position).field(c.width).field(c.height).field(c.angle).field(c.aperture).field(c.focusDistance)
+              .field(c.right).field(c.up).field(c.forward);
+    }
+
+    ContentHash& field(const SdfPrimitive &p) {
+        field(p.nodeCount);
+        for (int i = 0; i < p.nodeCount; ++i) field(p.nodes[i]);
+        return field(p.bounds).field(p.lipschitz).field(p.relaxation);
+    }
+
+    template <typename T>
+    ContentHash& fields(span<const T> items) {
+        field(items.size());
+        for (const T &item : items) field(item);
+        return *this;
+    }
+};
+
+uint64_t hashScene(const RuntimeScene &scene) {
+    ContentHash hash;
+    hash.fields(span<const Sphere>(scene.spheres)).fields(span<const SdfPrimitive>(scene.sdfs)).fields(span<const Light>(scene.lights));
+    for (const RuntimeMesh &mesh : scene.meshes) hash.fields(mesh.triangles);
+    return hash.field(scene.background).value;
+}
+
+AABB sceneBounds(const RuntimeScene &scene) {
+    AABB bounds;
+    for (const Sphere &s : scene.spheres) bounds.grow(s.bounds());
+    for (const RuntimeMesh &m : scene.meshes) bounds.grow(boundingSphere(m).bounds());
+    for (const SdfPrimitive &s : scene.sdfs) bounds.grow(s.bounds.bounds());
+    return bounds;
+}
+
+// renders the light's view of the occluders with the regular nearest-hit kernel
+template <typename Scene>
+ShadowMap buildShadowMap(const Scene &occluders, const Light &light, const ShadowMapSettings &settings) {
+    int res = settings.resolution;
+    ShadowMap map{ light.position, settings, vector<float>(6 * size_t(res) * res, INF) };
+    for (int face = 0; face < 6; ++face) {
+        for (int y = 0; y < res; ++y) {
+            for (int x = 0; x < res; ++x) {
+                Ray ray(light.position, ShadowMap::direction(face, (x + 0.5f) / res * 2 - 1, (y + 0.5f) / res * 2 - 1));
+                if (auto hit = nearestHit(ray, occluders); hit) map.depth[(size_t(face) * res + y) * res + x] = hit->t.first;
+            }
+        }
+    }
+    return map;
+}
+
+// runtime counterpart of the preprocessing main() does at compile time
+struct PreparedScene {
+    RuntimeScene full; // secondary rays can reach anything
+    RuntimeScene primary;
+    RuntimeScene shadow;
+    vector<ViewCone> viewCones;
+    vector<OccluderCone> occluderCones;
+    vector<ShadowMap> shadowMaps;
+    shared_ptr<IrradianceCache> irradiance;
+    vector<shared_ptr<const PreparedScene>> replicas; // per NUMA node, see replicatePerNode
+
+    // thin-lens rays leave the whole lens, neither the pinhole frustum nor the view cones bound them
+    PreparedScene(const RuntimeScene &scene, const Camera &camera) :
+                  full(scene),
+                  primary(camera.aperture > 0 ? scene : cullScene(scene, camera, PrimaryRays)),
+                  shadow(camera.aperture > 0 ? scene : cullScene(scene, camera, ShadowRays)),
+                  viewCones(camera.aperture > 0 ? vector<ViewCone>() : ::viewCones(primary.spheres, camera.position)),
+                  occluderCones(::occluderCones(shadow.lights, shadow.spheres)) {}
+
+    // shared by several pinhole views: primary holds what any of them sees and view cones
+    // are left to PreparedView, everything derived from lights is built once
+    PreparedScene(const RuntimeScene &scene, span<const Camera> cameras) :
+                  full(scene), primary(cullScene(scene, cameras, PrimaryRays)), shadow(cullScene(scene, cameras, ShadowRays)),
+                  occluderCones(::occluderCones(shadow.lights, shadow.spheres)) {}
+
+    void buildShadowMaps(const ShadowMapSettings &settings) {
+        shadowMaps.clear();
+        for (const Light &light : shadow.lights) shadowMaps.push_back(buildShadowMap(shadow, light, settings));
+    }
+
+    // indirect rays see the whole scene and are shaded with direct light only. The gather
+    // owns its copy of the scene: the cache outlives this object in copies and replicas.
+    void enableIrradianceCache(const IrradianceSettings &settings) {
+        irradiance = make_unique<IrradianceCache>(sceneBounds(full), settings, hashScene(full), [scene = make_shared<const RuntimeScene>(full)](const Ray &ray) {
+            auto hit = nearestHit(ray, *scene);
+            if (!hit) return GatherSample{ scene->background, INF };
+            return GatherSample{ shade(ray, &*hit, *scene, *scene, FrameContext{}, 1), hit->t.first };
+        });
+    }
+
+    // reproducible irradiance: the records the primary hits need are computed serially in
+    // scanline order, then the cache is frozen so parallel lookups only read it
+    void warmIrradianceCache(const Camera &camera) {
+        for (int y = 0; y < camera.height; y++) {
+            for (int x = 0; x < camera.width; x++) {
+                Ray ray = camera.primaryRay(x, y);
+                auto hit = nearestHit(ray, primary, viewCones);
+                if (!hit || hit->material != Diffuse) continue;
+                irradiance->irradiance(hit->point, ray.dir.dot(hit->normal) > 0 ? -hit->normal : hit->normal);
+            }
+        }
+        irradiance->freeze();
+    }
+
+    FrameContext frame(TraversalStats* stats = nullptr) const { return FrameContext{ viewCones, occluderCones, shadowMaps, irradiance.get(), stats }; }
+
+    const PreparedScene &local(unsigned node) const { return node < replicas.size() && replicas[node] ? *replicas[node] : *this; }
+};
+
+// differences of the 8-bit values save() would write
+struct ImageDifference {
+    double rmse = 0;
+    int maxError = 0;
+    double differingPixels = 0; // fraction of pixels with any channel off by more than one step
+};
+
+ImageDifference compareImages(const Canvas &a, const Canvas &b) {
+    ImageDifference diff;
+    size_t differing = 0;
+    for (size_t p = 0; p < a.pixels.size(); ++p) {
+        int worst = 0;
+        for (int c = 0; c < 3; ++c) {
+            int va = min(a.pixels[p][c] * 255.0, 255.0), vb = min(b.pixels[p][c] * 255.0, 255.0);
+            int e = abs(va - vb);
+            diff.rmse += double(e) * e;
+            worst = max(worst, e);
+        }
+        diff.maxError = max(diff.maxError, worst);
+        differing += worst > 1;
+    }
+    diff.rmse = sqrt(diff.rmse / (3.0 * a.pixels.size()));
+    diff.differingPixels = double(differing) / a.pixels.size();
+    return diff;
+}
+
+// ambient occlusion pass: per shading point, low-discrepancy hemisphere directions are
+// traced in packets of AO_PACKET any-hit rays. Spheres are tested a packet at a time from
+// a structure-of-arrays copy, lanes still open after that fall back to the scalar
+// any-hit kernels of meshes and SDFs.
+constexpr int AO_PACKET = 8;
+typedef float floatx8 __attribute__((vector_size(AO_PACKET * sizeof(float))));
+typedef int intx8 __attribute__((vector_size(AO_PACKET * sizeof(int))));
+
+struct AmbientOcclusionSettings {
+    int samples = 16;       // rounded up to whole packets
+    float maxDistance = 4;  // occluders farther away don't count
+};
+
+struct SphereSoA {
+    PageVector<float> x, y, z, radius2;
+
+    SphereSoA(const vector<Sphere> &spheres) {
+        for (const Sphere &s : spheres) {
+            x.push_back(s.center.x), y.push_back(s.center.y), z.push_back(s.center.z);
+            radius2.push_back(s.radius * s.radius);
+        }
+    }
+};
+
+// van der Corput sequence, the bits of i mirrored around the binary point
+constexpr float radicalInverse(uint32_t bits) {
+    bits = (bits << 16) | (bits >> 16);
+    bits = ((bits & 0x00ff00ffu) << 8) | ((bits & 0xff00ff00u) >> 8);
+    bits = ((bits & 0x0f0f0f0fu) << 4) | ((bits & 0xf0f0f0f0u) >> 4);
+    bits = ((bits & 0x33333333u) << 2) | ((bits & 0xccccccccu) >> 2);
+    bits = ((bits & 0x55555555u) << 1) | ((bits & 0xaaaaaaaau) >> 1);
+    return bits * (1.f / 4294967296.f);
+}
+
+// sets the lanes occluded within tmax to -1, same acceptance as Sphere::intersect
+void occludedPacket(const vec3 &orig, const floatx8 &dx, const floatx8 &dy, const floatx8 &dz, float tmax,
+                    const SphereSoA &spheres, const RuntimeScene &scene, intx8 &occluded) {
+    occluded = intx8{};
+    for (size_t i = 0; i < spheres.x.size(); ++i) {
+        float lx = spheres.x[i] - orig.x, ly = spheres.y[i] - orig.y, lz = spheres.z[i] - orig.z;
+        float l2 = lx * lx + ly * ly + lz * lz;
+        floatx8 tca = lx * dx + ly * dy + lz * dz;
+        floatx8 thc2 = spheres.radius2[i] - (l2 - tca * tca);
+        floatx8 beyond = tca - tmax; // t0 < tmax  <=>  beyond < 0 or beyond^2 < thc2
+        occluded |= (tca >= 0) & (thc2 >= 0) & ((beyond < 0) | (beyond * beyond < thc2));
+
+        bool all = true;
+        for (int lane = 0; lane < AO_PACKET; ++lane) all &= occluded[lane] != 0;
+        if (all) return;
+    }
+
+    for (int lane = 0; lane < AO_PACKET; ++lane) {
+        if (occluded[lane]) continue;
+        Ray ray(orig, vec3(dx[lane], dy[lane], dz[lane]));
+        for (const RuntimeMesh &mesh : scene.meshes) {
+            if (mesh.occluded(ray, tmax)) { occluded[lane] = -1; break; }
+        }
+        for (size_t s = 0; s < scene.sdfs.size() && !occluded[lane]; ++s) {
+            if (auto inter = scene.sdfs[s].intersect(ray); inter && inter->t.first < tmax) occluded[lane] = -1;
+        }
+    }
+}
+
+Canvas renderAmbientOcclusion(const PreparedScene &prepared, const Camera &camera, const AmbientOcclusionSettings &settings) {
+    const RuntimeScene &scene = prepared.full;
+    SphereSoA spheres(scene.spheres);
+    int packets = (settings.samples + AO_PACKET - 1) / AO_PACKET;
+    int samples = packets * AO_PACKET;
+
+    Canvas canvas(camera.width, camera.height);
+    for (int y = 0; y < camera.height; y++) {
+        for (int x = 0; x < camera.width; x++) {
+            auto hit = nearestHit(camera.primaryRay(x, y), prepared.primary, prepared.viewCones);
+            if (!hit) continue;
+
+            vec3 normal = hit->normal;
+            if (camera.primaryRay(x, y).dir.dot(normal) > 0) normal = -normal;
+            vec3 orig = hit->point + normal * SECONDARY_OFFSET;
+
+            // Hammersley points, rotated per pixel (Cranley-Patterson) to decorrelate neighbours
+            Sampler sampler(uint32_t(y) * camera.width + x, 0);
+            float r1 = sampler.next(), r2 = sampler.next();
+            int open = 0;
+            for (int p = 0; p < packets; ++p) {
+                floatx8 dx, dy, dz;
+                for (int lane = 0; lane < AO_PACKET; ++lane) {
+                    int i = p * AO_PACKET + lane;
+                    float u1 = float(i) / samples + r1, u2 = radicalInverse(i) + r2;
+                    vec3 dir = cosineHemisphere(normal, u1 - int(u1), u2 - int(u2));
+                    dx[lane] = dir.x, dy[lane] = dir.y, dz[lane] = dir.z;
+                }
+                intx8 occluded;
+                occludedPacket(orig, dx, dy, dz, settings.maxDistance, spheres, scene, occluded);
+                for (int lane = 0; lane < AO_PACKET; ++lane) open += occluded[lane] == 0;
+            }
+            canvas.set_pixel(x, y, vec3(float(open) / samples));
+        }
+    }
+    return canvas;
+}
+
+// thin-lens depth of field: a first pass traces one ray through the lens center per pixel
+// and estimates the circle of confusion from its depth. Blur spreads up to half a circle of
+// confusion into the neighbours, so the maxima are kept per DOF_TILE square tile, each tile's
+// maximum is spread over the tiles within half its circle (at least the adjacent ones), and a
+// pixel gets the stratified lens samples only if its tile then blurs by more than maxSharpCoc.
+// Misses see the uniform background and never blur themselves.
+constexpr int DOF_TILE = 8;
+
+struct DepthOfFieldSettings {
+    int lensSamples = 4;     // strata per lens axis
+    float maxSharpCoc = 0.5; // pixels
+};
+
+Canvas renderDepthOfField(const PreparedScene &prepared, const Camera &camera, const DepthOfFieldSettings &settings, size_t &sampledPixels) {
+    FrameContext frame = prepared.frame();
+    Canvas canvas(camera.width, camera.height);
+    int tilesX = (camera.width + DOF_TILE - 1) / DOF_TILE, tilesY = (camera.height + DOF_TILE - 1) / DOF_TILE;
+    vector<float> tileCoc(size_t(tilesX) * tilesY, 0);
+
+    for (int y = 0; y < camera.height; y++) {
+        for (int x = 0; x < camera.width; x++) {
+            Ray ray = camera.lensRay(x + 0.5f, y + 0.5f, 0.5f, 0.5f);
+            auto hit = nearestHit(ray, prepared.primary, frame.viewCones, frame.stats);
+            if (!hit) {
+                canvas.set_pixel(x, y, prepared.primary.background);
+                continue;
+            }
+            float &tile = tileCoc[size_t(y / DOF_TILE) * tilesX + x / DOF_TILE];
+            tile = max(tile, camera.circleOfConfusion(hit->t.first * ray.dir.dot(camera.forward)));
+            canvas.set_pixel(x, y, shade(ray, &*hit, prepared.primary, prepared.shadow, frame, 0));
+        }
+    }
+
+    vector<float> tileBlur(tileCoc.size(), 0);
+    for (int ty = 0; ty < tilesY; ++ty) {
+        for (int tx = 0; tx < tilesX; ++tx) {
+            float coc = tileCoc[size_t(ty) * tilesX + tx];
+            if (!(coc > settings.maxSharpCoc)) continue;
+            int reach = int(min(ceil(coc / 2 / DOF_TILE), float(max(tilesX, tilesY))));
+            reach = max(reach, 1);
+            for (int ny = max(ty - reach, 0); ny <= min(ty + reach, tilesY - 1); ++ny) {
+                for (int nx = max(tx - reach, 0); nx <= min(tx + reach, tilesX - 1); ++nx) {
+                    float &blur = tileBlur[size_t(ny) * tilesX + nx];
+                    blur = max(blur, coc);
+                }
+            }
+        }
+    }
+
+    sampledPixels = 0;
+    int n = settings.lensSamples;
+    for (int y = 0; y < camera.height; y++) {
+        for (int x = 0; x < camera.width; x++) {
+            if (tileBlur[size_t(y / DOF_TILE) * tilesX + x / DOF_TILE] <= settings.maxSharpCoc) continue;
+
+            sampledPixels++;
+            Sampler sampler(uint32_t(y) * camera.width + x, 0);
+            vec3 sum;
+            for (int i = 0; i < n; ++i) {
+                for (int j = 0; j < n; ++j) {
+                    float lu = (i + sampler.next()) / n, lv = (j + sampler.next()) / n;
+                    sum += trace(camera.lensRay(x + 0.5f, y + 0.5f, lu, lv), prepared.primary, prepared.shadow, frame, 0);
+                }
+            }
+            canvas.set_pixel(x, y, sum * (1.f / (n * n)));
+        }
+    }
+    return canvas;
+}
+
+// CPUs of each NUMA node from sysfs, limited to this process's affinity mask. Node ids may
+// have gaps; nodes without allowed CPUs are left out, so ids holds the kernel's id of every
+// entry in nodes. Without node directories (non-NUMA kernels, some containers) every allowed
+// CPU is on node 0.
+struct CpuTopology {
+    vector<vector<unsigned>> nodes;
+    vector<unsigned> ids;
+
+    static CpuTopology detect() {
+        cpu_set_t allowed;
+        CPU_ZERO(&allowed);
+        sched_getaffinity(0, sizeof(allowed), &allowed);
+        vector<unsigned> present;
+        error_code ignored;
+        for (const auto &entry : filesystem::directory_iterator("/sys/devices/system/node", ignored)) {
+            string name = entry.path().filename().string();
+            if (name.size() > 4 && name.rfind("node", 0) == 0 && all_of(name.begin() + 4, name.end(), [](char c) { return c >= '0' && c <= '9'; })) present.push_back(stoul(name.substr(4)));
+        }
+        sort(present.begin(), present.end());
+        CpuTopology topology;
+        for (unsigned node : present) {
+            ifstream list("/sys/devices/system/node/node" + to_string(node) + "/cpulist");
+            string ranges;
+            if (!getline(list, ranges)) continue;
+            vector<unsigned> cpus;
+            istringstream in(ranges);
+            for (string range; getline(in, range, ',');) {
+                unsigned first = 0, last = 0;
+                int fields = sscanf(range.c_str(), "%u-%u", &first, &last);
+                if (fields < 1) continue;
+                for (unsigned cpu = first; cpu <= (fields == 2 ? last : first); ++cpu) {
+                    if (cpu < CPU_SETSIZE && CPU_ISSET(cpu, &allowed)) cpus.push_back(cpu);
+                }
+            }
+            if (!cpus.empty()) topology.nodes.push_back(std::move(cpus)), topology.ids.push_back(node);
+        }
+        if (topology.nodes.empty()) {
+            topology.nodes.emplace_back();
+            topology.ids.push_back(0);
+            for (unsigned cpu = 0; cpu < CPU_SETSIZE; ++cpu) {
+                if (CPU_ISSET(cpu, &allowed)) topology.nodes[0].push_back(cpu);
+            }
+        }
+        return topology;
+    }
+};
+
+// moves the pages of size page lying wholly inside [data, data + bytes) to a NUMA node; false
+// (with errno set) where the kernel refuses, a range holding no whole page is not an error
+bool bindToNode(const void* data, size_t bytes, unsigned node, size_t page) {
+    uintptr_t first = (uintptr_t(data) + page - 1) / page * page, last = (uintptr_t(data) + bytes) / page * page;
+    if (last <= first) return true;
+    if (node >= 64) return errno = EINVAL, false;
+    unsigned long mask = 1ul << node;
+    return syscall(SYS_mbind, first, last - first, MPOL_BIND, &mask, 64, MPOL_MF_MOVE) == 0;
+}
+
+// fixed set of workers running batches of indexed jobs; run() blocks until the batch
+// is done and the calling thread takes jobs as well. A pinned pool binds participant p
+// (the calling thread is 0) to a CPU of node p % nodes(), so consecutive participants
+// alternate between sockets; the caller's previous affinity is restored on destruction.
+class ThreadPool {
+public:
+    explicit ThreadPool(unsigned threads = thread::hardware_concurrency(), bool pinned = false) :
+                        deques(max(threads, 1u)), nodeOf(max(threads, 1u), 0), victims(max(threads, 1u)) {
+        unsigned participants = max(threads, 1u);
+        vector<unsigned> cpuOf(participants, ~0u);
+        if (pinned) {
+            CpuTopology topology = CpuTopology::detect();
+            nodeCount = topology.nodes.size();
+            nodeIds = topology.ids;
+            for (unsigned p = 0; p < participants; ++p) {
+                nodeOf[p] = p % nodeCount;
+                const vector<unsigned> &cpus = topology.nodes[nodeOf[p]];
+                cpuOf[p] = cpus[p / nodeCount % cpus.size()];
+            }
+            CPU_ZERO(&callerAffinity);
+            callerPinned = sched_getaffinity(0, sizeof(callerAffinity), &callerAffinity) == 0 && pin(cpuOf[0]);
+        }
+        // thieves try their own node first
+        for (unsigned p = 0; p < participants; ++p) {
+            for (unsigned v = 1; v < participants; ++v) victims[p].push_back((p + v) % participants);
+            stable_partition(victims[p].begin(), victims[p].end(), [&](unsigned v) { return nodeOf[v] == nodeOf[p]; });
+        }
+        for (unsigned i = 1; i < participants; ++i) {
+            workers.emplace_back([this, i, cpu = cpuOf[i]] {
+                if (cpu != ~0u) pin(cpu);
+                work(i);
+            });
+        }
+    }
+
+    ~ThreadPool() {
+        {
+            lock_guard lock(guard);
+            stopping = true;
+        }
+        wake.notify_all();
+        for (thread &worker : workers) worker.join();
+        if (callerPinned) sched_setaffinity(0, sizeof(callerAffinity), &callerAffinity);
+    }
+
+    unsigned size() const { return workers.size() + 1; }
+    unsigned nodes() const { return nodeCount; }
+    unsigned node(unsigned participant) const { return nodeOf[participant]; }
+    // the kernel's id of node index node, what mbind takes
+    unsigned nodeId(unsigned node) const { return nodeIds[node]; }
+
+    // the participant running the current job, 0 outside of jobs
+    static unsigned participant() { return current; }
+
+    void run(size_t count, const function<void(size_t)> &job) {
+        {
+            lock_guard lock(guard);
+            batch = &job;
+            batchSize = count;
+            next = 0;
+            busy = workers.size();
+            ++generation;
+        }
+        wake.notify_all();
+        drain(0);
+        unique_lock lock(guard);
+        done.wait(lock, [this] { return busy == 0; });
+    }
+
+    // every participant runs job(participant) once, on its own thread
+    void runOnEach(const function<void(size_t)> &job) {
+        mode = Broadcast;
+        run(size(), job);
+        mode = Shared;
+    }
+
+    // items are dealt round robin, item i to participant i % size(), unless owners names a
+    // participant per item. Each takes its own items in order, then steals from the back of
+    // the others (its own node first): with items sorted most expensive first, every thread
+    // starts on expensive ones and only cheap ones move.
+    void runStealing(size_t count, const function<void(size_t)> &job, span<const unsigned> owners = {}) {
+        unsigned participants = size();
+        vector<uint32_t> offsets(participants + 1, 0);
+        for (size_t i = 0; i < count; ++i) offsets[(owners.empty() ? i % participants : owners[i]) + 1]++;
+        for (unsigned p = 0; p < participants; ++p) offsets[p + 1] += offsets[p];
+        dealt.resize(count);
+        vector<uint32_t> filled(offsets.begin(), offsets.end() - 1);
+        for (size_t i = 0; i < count; ++i) dealt[filled[owners.empty() ? i % participants : owners[i]]++] = i;
+        for (unsigned p = 0; p < participants; ++p) deques[p].range = uint64_t(offsets[p]) << 32 | offsets[p + 1];
+        stolenItems = 0;
+        mode = Stealing;
+        run(count, job);
+        mode = Shared;
+    }
+
+    // items the last runStealing moved between threads
+    size_t stolen() const { return stolenItems; }
+
+private:
+    enum Mode { Shared, Stealing, Broadcast };
+
+    // a participant's share of dealt as [front, back) in one word, owner and thieves claim with one CAS each
+    struct alignas(64) Deque {
+        atomic<uint64_t> range = 0;
+    };
+
+    static bool pin(unsigned cpu) {
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        CPU_SET(cpu, &set);
+        return pthread_setaffinity_np(pthread_self(), sizeof(set), &set) == 0;
+    }
+
+    static bool take(Deque &deque, bool front, uint32_t &item) {
+        uint64_t range = deque.range.load();
+        while (true) {
+            uint32_t first = range >> 32, last = uint32_t(range);
+            if (first >= last) return false;
+            uint64_t taken = front ? uint64_t(first + 1) << 32 | last : uint64_t(first) << 32 | (last - 1);
+            if (deque.range.compare_exchange_weak(range, taken)) {
+                item = front ? first : last - 1;
+                return true;
+            }
+        }
+    }
+
+    void drain(unsigned self) {
+        current = self;
+        if (mode == Broadcast) {
+            (*batch)(self);
+        } else if (mode == Stealing) {
+            for (uint32_t k; take(deques[self], true, k);) (*batch)(dealt[k]);
+            for (unsigned victim : victims[self]) {
+                for (uint32_t k; take(deques[victim], false, k); ++stolenItems) (*batch)(dealt[k]);
+            }
+        } else {
+            for (size_t i = next++; i < batchSize; i = next++) (*batch)(i);
+        }
+        current = 0;
+    }
+
+    void work(unsigned self) {
+        uint64_t seen = 0;
+        while (true) {
+            {
+                unique_lock lock(guard);
+                wake.wait(lock, [&] { return stopping || generation != seen; });
+                if (stopping) return;
+                seen = generation;
+            }
+            drain(self);
+            lock_guard lock(guard);
+            if (--busy == 0) done.notify_one();
+        }
+    }
+
+    static inline thread_local unsigned current = 0;
+
+    vector<Deque> deques;
+    vector<uint32_t> dealt;
+    vector<unsigned> nodeOf;
+    vector<vector<unsigned>> victims;
+    unsigned nodeCount = 1;
+    vector<unsigned> nodeIds = { 0 };
+    cpu_set_t callerAffinity;
+    bool callerPinned = false;
+    vector<thread> workers;
+    mutex guard;
+    condition_variable wake, done;
+    const function<void(size_t)>* batch = nullptr;
+    size_t batchSize = 0;
+    atomic<size_t> next = 0;
+    Mode mode = Shared;
+    atomic<size_t> stolenItems = 0;
+    size_t busy = 0;
+    uint64_t generation = 0;
+    bool stopping = false;
+};
+
+// copies of the read-only scene for every other node of a pinned pool, each made by the node's
+// first participant (participant n for node n) so first touch puts its pages there. Meshes get
+// their own triangles and BVH (in the current page mode), the irradiance cache stays shared.
+// Call it after the shadow maps are built, replicas are snapshots.
+void replicatePerNode(PreparedScene &prepared, ThreadPool &pool) {
+    prepared.replicas.clear();
+    if (pool.nodes() <= 1) return;
+    vector<shared_ptr<const PreparedScene>> replicas(pool.nodes());
+    pool.runOnEach([&](size_t p) {
+        unsigned node = pool.node(p);
+        if (node == 0 || p >= pool.nodes()) return;
+        auto replica = make_shared<PreparedScene>(prepared);
+        // full, primary and shadow share mesh storage, so do the copies
+        map<const BVHNode*, RuntimeMesh> relocated;
+        for (RuntimeScene* scene : { &replica->full, &replica->primary, &replica->shadow }) {
+            for (RuntimeMesh &mesh : scene->meshes) {
+                auto found = relocated.find(mesh.nodes.data());
+                if (found == relocated.end()) found = relocated.emplace(mesh.nodes.data(), mesh.relocated()).first;
+                mesh = found->second;
+            }
+        }
+        replicas[node] = std::move(replica);
+    });
+    prepared.replicas = std::move(replicas);
+}
+
+// the per-camera part of a multi-view render, culled from the shared primary scene
+struct PreparedView {
+    Camera camera;
+    RuntimeScene primary;
+    vector<ViewCone> viewCones;
+
+    PreparedView(const PreparedScene &shared, const Camera &camera) :
+                 camera(camera), primary(cullScene(shared.primary, camera, PrimaryRays)), viewCones(::viewCones(primary.spheres, camera.position)) {}
+};
+
+// adaptive tiles: a view's cost is kept per COST_CELL x COST_CELL block of pixels, either
+// probed (one timed ray per block) or measured while the previous frame rendered. Tiles
+// start at MAX_TILE and are split in quarters down to COST_CELL while they cost more than
+// 1/TILES_PER_THREAD of a thread's share, so cheap regions stay in few large tiles and
+// expensive ones are spread over many small ones. Tiles run most expensive first.
+constexpr int COST_CELL = 8;
+constexpr int COST_PROBE_RAYS = 2; // per block axis, one clock reading covers the block's batch
+constexpr int MAX_TILE = 64;
+constexpr int TILES_PER_THREAD = 8;
+
+struct TileCosts {
+    int cellsX = 0, cellsY = 0;
+    vector<float> seconds; // per block
+    size_t tiles = 0;      // tiles the last render used
+
+    TileCosts() = default;
+    TileCosts(const Camera &camera) : cellsX((camera.width + COST_CELL - 1) / COST_CELL), cellsY((camera.height + COST_CELL - 1) / COST_CELL),
+                                      seconds(size_t(cellsX) * cellsY, 0) {}
+
+    bool fits(const Camera &camera) const { return cellsX == (camera.width + COST_CELL - 1) / COST_CELL && cellsY == (camera.height + COST_CELL - 1) / COST_CELL; }
+
+    // pixel rectangles here are aligned to blocks, except where clipped by the image
+    float cost(int x0, int y0, int x1, int y1) const {
+        float sum = 0;
+        for (int y = y0 / COST_CELL; y < (y1 + COST_CELL - 1) / COST_CELL; ++y) {
+            for (int x = x0 / COST_CELL; x < (x1 + COST_CELL - 1) / COST_CELL; ++x) sum += seconds[size_t(y) * cellsX + x];
+        }
+        return sum;
+    }
+
+    // spreads a measured tile time evenly over its pixels
+    void record(int x0, int y0, int x1, int y1, float tileSeconds) {
+        float perPixel = tileSeconds / max((x1 - x0) * (y1 - y0), 1);
+        for (int y = y0; y < y1; y += COST_CELL) {
+            for (int x = x0; x < x1; x += COST_CELL) seconds[size_t(y / COST_CELL) * cellsX + x / COST_CELL] = perPixel * (min(x + COST_CELL, x1) - x) * (min(y + COST_CELL, y1) - y);
+        }
+    }
+};
+
+// each block times a small batch of rays, a single ray costs about as much as reading the clock.
+// Rows of blocks are spread over the pool, the probe traces 1/16 of the primary rays.
+// The probe must not seed the irradiance cache, it shades direct light only.
+TileCosts probeTileCosts(const PreparedScene &prepared, const PreparedView &view, ThreadPool &pool) {
+    const Camera &camera = view.camera;
+    TileCosts costs(camera);
+    FrameContext frame = prepared.frame();
+    frame.viewCones = view.viewCones;
+    frame.irradiance = nullptr;
+    vector<float> sinks(costs.cellsY, 0);
+    pool.run(costs.cellsY, [&](size_t cy) {
+        vec3 sink = 0;
+        for (int cx = 0; cx < costs.cellsX; ++cx) {
+            int x0 = cx * COST_CELL, y0 = cy * COST_CELL, x1 = min(x0 + COST_CELL, camera.width), y1 = min(y0 + COST_CELL, camera.height);
+            auto start = chrono::steady_clock::now();
+            for (int j = 0; j < COST_PROBE_RAYS; ++j) {
+                for (int i = 0; i < COST_PROBE_RAYS; ++i) {
+                    int x = x0 + (2 * i + 1) * (x1 - x0) / (2 * COST_PROBE_RAYS), y = y0 + (2 * j + 1) * (y1 - y0) / (2 * COST_PROBE_RAYS);
+                    sink += trace(camera.primaryRay(x, y), view.primary, prepared.shadow, frame, 0);
+                }
+            }
+            float seconds = chrono::duration<float>(chrono::steady_clock::now() - start).count();
+            costs.seconds[cy * costs.cellsX + cx] = seconds * (x1 - x0) * (y1 - y0) / (COST_PROBE_RAYS * COST_PROBE_RAYS);
+        }
+        sinks[cy] = sink.x;
+    });
+    volatile float used = 0; // keeps the probe's traces from being optimized away
+    for (float sink : sinks) used = used + sink;
+    return costs;
+}
+
+struct ViewTile {
+    unsigned view;
+    int x0, y0, x1, y1;
+    float cost;
+};
+
+void splitTile(vector<ViewTile> &tiles, const TileCosts &costs, const ViewTile &tile, int size, float target) {
+    if (size <= COST_CELL || tile.cost <= target) {
+        tiles.push_back(tile);
+        return;
+    }
+    int half = size / 2;
+    for (int y = tile.y0; y < tile.y1; y += half) {
+        for (int x = tile.x0; x < tile.x1; x += half) {
+            ViewTile quarter{ tile.view, x, y, min(x + half, tile.x1), min(y + half, tile.y1), 0 };
+            quarter.cost = costs.cost(quarter.x0, quarter.y0, quarter.x1, quarter.y1);
+            splitTile(tiles, costs, quarter, half, target);
+        }
+    }
+}
+
+// cuts a framebuffer into one band per node of the pool at boundaries of the pages backing it,
+// so no page is split between nodes, and moves each band to its node. Returns the node index of
+// every row, a row straddling a cut goes with its first pixel. Placement failures are reported
+// once per process.
+vector<unsigned> placeBands(Canvas &canvas, const ThreadPool &pool) {
+    unsigned nodes = pool.nodes();
+    vector<unsigned> rowNode(canvas.height, 0);
+    if (nodes <= 1) return rowNode;
+    size_t rowBytes = size_t(canvas.width) * sizeof(vec3), bytes = rowBytes * canvas.height;
+    size_t page = HugePages::pageSize(bytes);
+    uintptr_t start = uintptr_t(canvas.pixels.data()), end = start + bytes;
+    vector<uintptr_t> cuts = { start };
+    for (unsigned node = 1; node < nodes; ++node) cuts.push_back(min(end, (start + bytes * node / nodes + page - 1) / page * page));
+    cuts.push_back(end);
+
+    static atomic<bool> reported = false;
+    for (unsigned node = 0; node < nodes; ++node) {
+        if (!bindToNode(reinterpret_cast<const void*>(cuts[node]), cuts[node + 1] - cuts[node], pool.nodeId(node), page) && !reported.exchange(true)) {
+            cerr << "cannot move framebuffer pages to NUMA node " << pool.nodeId(node) << ": " << strerror(errno) << ", they stay where first touched" << endl;
+        }
+    }
+    for (int y = 0; y < canvas.height; ++y) rowNode[y] = upper_bound(cuts.begin() + 1, cuts.end() - 1, start + y * rowBytes) - (cuts.begin() + 1);
+    return rowNode;
+}
+
+// renders pinhole views of one prepared scene, the tiles of every view go to the same pool;
+// once *cancelled is set the remaining tiles are skipped. heatmaps, if given, holds one
+// TileCosts per view: costs from a previous frame replace the probe, and every entry is
+// overwritten with the costs measured in this render.
+//
+// On a pool spanning several NUMA nodes each view's rows are split into one band per node
+// (see placeBands), the band's framebuffer pages are moved to that node and its tiles are dealt to that node's
+// threads, which trace them against the node's scene replica and their own culled views.
+vector<Canvas> renderViews(const PreparedScene &prepared, span<const Camera> cameras, ThreadPool &pool, const atomic<bool>* cancelled = nullptr,
+                           TileCosts* heatmaps = nullptr) {
+    unsigned nodes = pool.nodes();
+    vector<vector<PreparedView>> nodeViews(nodes);
+    vector<Canvas> canvases;
+    vector<TileCosts> costs;
+    for (unsigned v = 0; v < cameras.size(); ++v) {
+        assert(cameras[v].aperture == 0);
+        nodeViews[0].emplace_back(prepared, cameras[v]);
+        canvases.emplace_back(cameras[v].width, cameras[v].height);
+        costs.push_back(heatmaps && heatmaps[v].fits(cameras[v]) ? heatmaps[v] : probeTileCosts(prepared, nodeViews[0][v], pool));
+    }
+    vector<vector<unsigned>> rowNodes;
+    for (Canvas &canvas : canvases) rowNodes.push_back(placeBands(canvas, pool));
+    if (nodes > 1) {
+        pool.runOnEach([&](size_t p) {
+            unsigned node = pool.node(p);
+            if (node == 0 || p >= nodes) return;
+            for (const Camera &camera : cameras) nodeViews[node].emplace_back(prepared.local(node), camera);
+        });
+    }
+
+    vector<ViewTile> tiles;
+    float total = 0;
+    for (const TileCosts &view : costs) {
+        for (float seconds : view.seconds) total += seconds;
+    }
+    // expensive tiles are quartered, runs of cheap ones along a row are merged while their sum stays under target
+    float target = total / (pool.size() * TILES_PER_THREAD);
+    for (unsigned v = 0; v < cameras.size(); ++v) {
+        for (int y = 0; y < cameras[v].height; y += MAX_TILE) {
+            optional<ViewTile> run;
+            for (int x = 0; x < cameras[v].width; x += MAX_TILE) {
+                ViewTile tile{ v, x, y, min(x + MAX_TILE, cameras[v].width), min(y + MAX_TILE, cameras[v].height), 0 };
+                tile.cost = costs[v].cost(tile.x0, tile.y0, tile.x1, tile.y1);
+                if (run && run->cost + tile.cost <= target) {
+                    run->x1 = tile.x1;
+                    run->cost += tile.cost;
+                    continue;
+                }
+                if (run) tiles.push_back(*run), run.reset();
+                if (tile.cost <= target) run = tile;
+                else splitTile(tiles, costs[v], tile, MAX_TILE, target);
+            }
+            if (run) tiles.push_back(*run);
+        }
+        costs[v].tiles = 0;
+    }
+    stable_sort(tiles.begin(), tiles.end(), [](const ViewTile &a, const ViewTile &b) { return a.cost > b.cost; });
+    for (const ViewTile &tile : tiles) costs[tile.view].tiles++;
+
+    // a node's tiles go round robin to its participants (participant p is on node p % nodes)
+    vector<unsigned> owners;
+    if (nodes > 1) {
+        vector<unsigned> dealtOnNode(nodes, 0);
+        unsigned participants = pool.size();
+        for (const ViewTile &tile : tiles) {
+            unsigned node = rowNodes[tile.view][tile.y0];
+            unsigned onNode = participants > node ? (participants - node + nodes - 1) / nodes : 0;
+            owners.push_back(onNode == 0 ? dealtOnNode[node]++ % participants : node + dealtOnNode[node]++ % onNode * nodes);
+        }
+    }
+
+    // tiles only write their own blocks of the heatmap
+    pool.runStealing(tiles.size(), [&](size_t i) {
+        if (cancelled && *cancelled) return;
+        Instrument::Scope scope("tile");
+        const ViewTile &tile = tiles[i];
+        unsigned node = pool.node(ThreadPool::participant());
+        const PreparedScene &scene = prepared.local(node);
+        const PreparedView &view = nodeViews[node].empty() ? nodeViews[0][tile.view] : nodeViews[node][tile.view];
+        FrameContext frame = scene.frame();
+        frame.viewCones = view.viewCones;
+        auto start = chrono::steady_clock::now();
+        for (int y = tile.y0; y < tile.y1; ++y) {
+            for (int x = tile.x0; x < tile.x1; ++x) {
+                canvases[tile.view].set_pixel(x, y, trace(view.camera.primaryRay(x, y), view.primary, scene.shadow, frame, 0));
+            }
+        }
+        costs[tile.view].record(tile.x0, tile.y0, tile.x1, tile.y1, chrono::duration<float>(chrono::steady_clock::now() - start).count());
+    }, owners);
+    if (heatmaps) move(costs.begin(), costs.end(), heatmaps);
+    return canvases;
+}
+
+// equirectangular panorama around a camera's position: columns are longitude, rows latitude,
+// the image center looks along the camera's forward axis. Sines and cosines are tabulated
+// once per column and per row, so ray generation is a few multiply-adds per pixel.
+struct EquirectProjection {
+    vec3 position, right, up, forward;
+    int width, height;
+    vector<float> sinLon, cosLon, sinLat, cosLat;
+
+    explicit EquirectProjection(const Camera &camera) :
+             position(camera.position), right(camera.right), up(camera.up), forward(camera.forward), width(camera.width), height(camera.height),
+             sinLon(width), cosLon(width), sinLat(height), cosLat(height) {
+        for (int x = 0; x < width; ++x) {
+            double lon = 2 * M_PI * (x + 0.5) / width - M_PI;
+            sinLon[x] = sin(lon), cosLon[x] = cos(lon);
+        }
+        for (int y = 0; y < height; ++y) {
+            double lat = M_PI / 2 - M_PI * (y + 0.5) / height;
+            sinLat[y] = sin(lat), cosLat[y] = cos(lat);
+        }
+    }
+
+    Ray ray(int x, int y) const {
+        return Ray(position, (right * (cosLat[y] * sinLon[x]) + up * sinLat[y] + forward * (cosLat[y] * cosLon[x])).normalize());
+    }
+};
+
+// rows are the jobs; the panorama sees all of prepared.primary, but the eye is fixed so
+// view cones still apply. Only the camera's position, basis and size are used.
+Canvas renderEquirect(const PreparedScene &prepared, const Camera &camera, ThreadPool &pool) {
+    EquirectProjection projection(camera);
+    Canvas canvas(projection.width, projection.height);
+    vector<ViewCone> cones = viewCones(prepared.primary.spheres, camera.position);
+    FrameContext frame = prepared.frame();
+    frame.viewCones = cones;
+    pool.run(projection.height, [&](size_t y) {
+        for (int x = 0; x < projection.width; ++x) canvas.set_pixel(x, y, trace(projection.ray(x, y), prepared.primary, prepared.shadow, frame, 0));
+    });
+    return canvas;
+}
+
+// six 90 degree pinhole cameras around position, ordered +x, -x, +y, -y, +z, -z
+array<Camera, 6> cubeFaceCameras(const vec3 &position, int resolution) {
+    const vec3 forwards[6] = { vec3(1, 0, 0), vec3(-1, 0, 0), vec3(0, 1, 0), vec3(0, -1, 0), vec3(0, 0, 1), vec3(0, 0, -1) };
+    const vec3 ups[6] = { vec3(0, 1, 0), vec3(0, 1, 0), vec3(0, 0, 1), vec3(0, 0, -1), vec3(0, 1, 0), vec3(0, 1, 0) };
+    array<Camera, 6> faces = { Camera(position, resolution, resolution, 90), Camera(position, resolution, resolution, 90),
+                               Camera(position, resolution, resolution, 90), Camera(position, resolution, resolution, 90),
+                               Camera(position, resolution, resolution, 90), Camera(position, resolution, resolution, 90) };
+    for (int face = 0; face < 6; ++face) {
+        faces[face].forward = forwards[face];
+        faces[face].up = ups[face];
+        faces[face].right = forwards[face].cross(ups[face]);
+    }
+    return faces;
+}
+
+// render-time estimates: a frame costs intersection work per pixel, derived from scene
+// statistics, times the seconds one unit of work takes on this machine. That factor is
+// measured by the tile cost probe, warmed up once and repeated PROBE_REPEATS times for the
+// median, and refined by every full render observed afterwards.
+constexpr int PROBE_REPEATS = 5;
+
+struct FrameStatistics {
+    double pixels = 0;
+    int samples = 1;
+    size_t lights = 0;
+    double primaryWork = 0; // intersection tests a camera ray pays for
+    double shadowWork = 0;  // intersection tests a shadow ray pays for
+    int depth = 1;          // rays per path; shade() ends paths at the first hit
+
+    double workPerPixel() const { return samples * depth * (1 + primaryWork + lights * (1 + shadowWork)); }
+    double work() const { return pixels * workPerPixel(); }
+};
+
+// spheres are tested one by one, meshes cost a BVH descent, SDFs a bounds test plus a
+// short march over their nodes
+double intersectionWork(const RuntimeScene &scene) {
+    double work = scene.spheres.size();
+    for (const RuntimeMesh &mesh : scene.meshes) work += 2 * log2(double(mesh.triangles.size()) + 1);
+    for (const SdfPrimitive &sdf : scene.sdfs) work += 1 + sdf.nodeCount;
+    return work;
+}
+
+FrameStatistics frameStatistics(const RuntimeScene &primary, const RuntimeScene &shadow, const Camera &camera, int samples = 1) {
+    FrameStatistics stats;
+    stats.pixels = double(camera.width) * camera.height;
+    stats.samples = samples;
+    stats.lights = shadow.lights.size();
+    stats.primaryWork = intersectionWork(primary);
+    stats.shadowWork = intersectionWork(shadow);
+    return stats;
+}
+
+// statistics of a scene not prepared yet, culled the way PreparedScene will cull it, so they
+// match what CostModel::calibrate was fitted on
+FrameStatistics frameStatistics(const RuntimeScene &scene, const Camera &camera, int samples = 1) {
+    if (camera.aperture > 0) return frameStatistics(scene, scene, camera, samples);
+    return frameStatistics(cullScene(scene, camera, PrimaryRays), cullScene(scene, camera, ShadowRays), camera, samples);
+}
+
+class CostModel {
+public:
+    bool calibrated() const { return secondsPerWork > 0; }
+
+    // runs the tile cost probe once to warm the caches and then PROBE_REPEATS times, and fits
+    // secondsPerWork to the median of the summed block costs. Returns the time of all passes.
+    double calibrate(const PreparedScene &prepared, const Camera &camera, ThreadPool &pool) {
+        auto start = chrono::steady_clock::now();
+        PreparedView view(prepared, camera);
+        array<double, PROBE_REPEATS + 1> passes;
+        for (double &seconds : passes) {
+            TileCosts costs = probeTileCosts(prepared, view, pool);
+            seconds = 0;
+            for (float block : costs.seconds) seconds += block;
+        }
+        nth_element(passes.begin() + 1, passes.begin() + 1 + PROBE_REPEATS / 2, passes.end()); // the first pass only warmed up
+        FrameStatistics stats = frameStatistics(prepared.primary, prepared.shadow, camera);
+        secondsPerWork = passes[1 + PROBE_REPEATS / 2] / max(stats.work(), 1.0);
+        return chrono::duration<double>(chrono::steady_clock::now() - start).count();
+    }
+
+    double estimate(const FrameStatistics &stats, unsigned threads) const { return secondsPerWork * stats.work() / max(threads, 1u); }
+
+    // full renders include tile scheduling and the pixels the probe skipped, later
+    // estimates move halfway towards each measurement
+    void observe(const FrameStatistics &stats, unsigned threads, double seconds) {
+        double measured = seconds * max(threads, 1u) / max(stats.work(), 1.0);
+        secondsPerWork = calibrated() ? (secondsPerWork + measured) / 2 : measured;
+    }
+
+private:
+    double secondsPerWork = 0;
+};
+
+// hardware counters of the calling thread (user space only) around a stage, read as one
+// perf_event group so all values cover the same interval. When the kernel multiplexes the
+// group, counts are scaled by enabled/running time. Cycles lead the group; an event the CPU or
+// hypervisor lacks is left out of it and reads as 0, so the others still count. Pool workers
+// are not counted, stages measure everything with --threads 1.
+struct CounterValues {
+    uint64_t cycles = 0, instructions = 0, l1dMisses = 0, llcMisses = 0, branchMisses = 0, dtlbMisses = 0;
+};
+
+class PerfCounters {
+public:
+    enum Event { Cycles, Instructions, L1dMisses, LlcMisses, BranchMisses, DtlbMisses, COUNTERS };
+
+    PerfCounters() {
+        const char* names[COUNTERS] = { "cycles", "instructions", "L1D misses", "LLC misses", "branch mispredicts", "dTLB misses" };
+        const pair<uint32_t, uint64_t> events[COUNTERS] = {
+            { PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES },
+            { PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS },
+            { PERF_TYPE_HW_CACHE, PERF_COUNT_HW_CACHE_L1D | PERF_COUNT_HW_CACHE_OP_READ << 8 | PERF_COUNT_HW_CACHE_RESULT_MISS << 16 },
+            { PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES },
+            { PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_MISSES },
+            { PERF_TYPE_HW_CACHE, PERF_COUNT_HW_CACHE_DTLB | PERF_COUNT_HW_CACHE_OP_READ << 8 | PERF_COUNT_HW_CACHE_RESULT_MISS << 16 },
+        };
+        for (int i = 0; i < COUNTERS; ++i) {
+            perf_event_attr attr{};
+            attr.size = sizeof(attr);
+            attr.type = events[i].first;
+            attr.config = events[i].second;
+            attr.disabled = i == 0;
+            attr.exclude_kernel = 1;
+            attr.exclude_hv = 1;
+            attr.read_format = PERF_FORMAT_GROUP | PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+            fds[i] = syscall(SYS_perf_event_open, &attr, 0, -1, i == 0 ? -1 : fds[0], 0);
+            if (fds[i] < 0 && i == 0) {
+                error = string("perf_event_open: ") + strerror(errno);
+                return;
+            }
+            if (fds[i] < 0) missing += (missing.empty() ? "" : ", ") + string(names[i]);
+            else slots[i] = grouped++;
+        }
+    }
+
+    ~PerfCounters() {
+        for (int fd : fds) {
+            if (fd >= 0) close(fd);
+        }
+    }
+
+    PerfCounters(const PerfCounters &) = delete;
+    PerfCounters& operator=(const PerfCounters &) = delete;
+
+    bool available() const { return error.empty(); }
+    const string& unavailableReason() const { return error; }
+    bool counts(Event event) const { return available() && slots[event] >= 0; }
+    // events left out of the group, empty when all count
+    const string& missingEvents() const { return missing; }
+
+    void start() {
+        ioctl(fds[0], PERF_EVENT_IOC_RESET, PERF_IOC_FLAG_GROUP);
+        ioctl(fds[0], PERF_EVENT_IOC_ENABLE, PERF_IOC_FLAG_GROUP);
+    }
+
+    CounterValues stop() {
+        ioctl(fds[0], PERF_EVENT_IOC_DISABLE, PERF_IOC_FLAG_GROUP);
+        uint64_t data[3 + COUNTERS] = {};
+        if (read(fds[0], data, sizeof(data)) < ssize_t((3 + grouped) * sizeof(uint64_t))) return {};
+        double scale = data[2] ? double(data[1]) / data[2] : 0; // enabled / running
+        auto value = [&](int i) { return slots[i] < 0 ? 0 : uint64_t(data[3 + slots[i]] * scale); };
+        return CounterValues{ value(0), value(1), value(2), value(3), value(4), value(5) };
+    }
+
+private:
+    int fds[COUNTERS] = { -1, -1, -1, -1, -1, -1 };
+    int slots[COUNTERS] = { -1, -1, -1, -1, -1, -1 }; // position in the group's read, -1 when missing
+    int grouped = 0;
+    string error, missing;
+};
+
+// per stage totals and per ray averages; IPC well below 1 with many cache misses per ray
+// points at memory, high IPC with few misses at arithmetic
+void printCounters(span<const pair<string, pair<CounterValues, double>>> stages) {
+    for (const auto &[name, stage] : stages) {
+        const auto &[c, rays] = stage;
+        double r = max(rays, 1.0);
+        cout << name << ": " << c.cycles << " cycles, IPC " << (c.cycles ? double(c.instructions) / c.cycles : 0) << "; per ray " << c.cycles / r
+             << " cycles, " << c.instructions / r << " instructions, " << c.l1dMisses / r << " L1D misses, " << c.llcMisses / r << " LLC misses, "
+             << c.branchMisses / r << " branch mispredicts, " << c.dtlbMisses / r << " dTLB misses" << endl;
+    }
+}
+
+// renders the scene repeatedly at runtime and reports throughput plus the
+// per-triangle memory and BVH traversal cost of the meshes it contains
+void benchmark(const RuntimeScene &scene, const Camera &camera, int frames, bool countEvents = false) {
+    using clock = chrono::steady_clock;
+
+    Canvas canvas(camera.width, camera.height);
+    auto start = clock::now();
+    PreparedScene prepared(scene, camera);
+    const RuntimeScene &primary = prepared.primary, &shadow = prepared.shadow;
+    TraversalStats coneStats;
+    for (int frame = 0; frame < frames; ++frame) render(primary, shadow, prepared.frame(&coneStats), camera, canvas);
+    double seconds = chrono::duration<double>(clock::now() - start).count();
+
+    double rays = double(frames) * camera.width * camera.height;
+    cout << "frames: " << frames << ", " << seconds * 1000 / frames << " ms/frame, "
+         << rays / seconds * 1e-6 << " Mprimary rays/s" << endl;
+    cout << "primary rays see " << primary.spheres.size() << "/" << scene.spheres.size() << " spheres, "
+         << primary.meshes.size() << "/" << scene.meshes.size() << " meshes, " << primary.sdfs.size() << "/" << scene.sdfs.size()
+         << " sdfs; shadow rays see " << shadow.spheres.size() << ", " << shadow.meshes.size() << ", " << shadow.sdfs.size() << endl;
+    cout << "view cones rejected " << coneStats.coneRejects << " of " << coneStats.coneTests << " primary sphere tests ("
+         << 100.0 * coneStats.coneRejects / max<unsigned long long>(coneStats.coneTests, 1) << "%)" << endl;
+    cout << "occluder cones rejected " << coneStats.shadowConeRejects << " of " << coneStats.shadowConeTests << " shadow sphere tests ("
+         << 100.0 * coneStats.shadowConeRejects / max<unsigned long long>(coneStats.shadowConeTests, 1) << "%)" << endl;
+
+    if (countEvents) {
+        PerfCounters counters;
+        if (!counters.available()) {
+            cout << "hardware counters unavailable (" << counters.unavailableReason() << ")" << endl;
+        } else {
+            if (!counters.missingEvents().empty()) cout << "not counted, read as 0: " << counters.missingEvents() << endl;
+            vector<pair<string, pair<CounterValues, double>>> stages;
+            double pixels = double(camera.width) * camera.height;
+
+            counters.start();
+            render(primary, shadow, prepared.frame(), camera, canvas);
+            stages.push_back({ "frame", { counters.stop(), pixels } });
+
+            // Sphere::intersect alone, every primary ray against every visible sphere
+            size_t sphereHits = 0;
+            counters.start();
+            for (int y = 0; y < camera.height; y++) {
+                for (int x = 0; x < camera.width; x++) {
+                    Ray ray = camera.primaryRay(x, y);
+                    for (const Sphere &sphere : primary.spheres) sphereHits += sphere.intersect(ray).has_value();
+                }
+            }
+            stages.push_back({ "sphere intersect", { counters.stop(), pixels * max<size_t>(primary.spheres.size(), 1) } });
+
+            vector<Ray> shadowRays;
+            for (int y = 0; y < camera.height; y++) {
+                for (int x = 0; x < camera.width; x++) {
+                    Ray ray = camera.primaryRay(x, y);
+                    auto hit = nearestHit(ray, primary, prepared.viewCones);
+                    if (!hit) continue;
+                    vec3 normal = ray.dir.dot(hit->normal) > 0 ? -hit->normal : hit->normal;
+                    for (const Light &light : shadow.lights) shadowRays.push_back(Ray(hit->point + normal * SHADOW_OFFSET, (light.position - hit->point).normalize()));
+                }
+            }
+            size_t blocked = 0;
+            counters.start();
+            for (size_t i = 0; i < shadowRays.size(); ++i) blocked += occluded(shadowRays[i], shadow, INF);
+            stages.push_back({ "shadow rays", { counters.stop(), double(shadowRays.size()) } });
+
+            cout << "hardware counters (" << sphereHits << " sphere hits, " << blocked << " shadow rays blocked):" << endl;
+            printCounters(stages);
+        }
+    }
+
+    for (size_t m = 0; m < scene.meshes.size(); ++m) {
+        const RuntimeMesh &mesh = scene.meshes[m];
+        size_t tris = mesh.triangles.size();
+        size_t bytes = tris * sizeof(Triangle) + mesh.nodes.size() * sizeof(BVHNode);
+
+        TraversalStats stats;
+        unsigned long long hits = 0;
+        start = clock::now();
+        for (int y = 0; y < camera.height; y++) {
+            for (int x = 0; x < camera.width; x++) {
+                if (mesh.intersect(camera.primaryRay(x, y), INF, &stats)) ++hits;
+            }
+        }
+        double meshSeconds = chrono::duration<double>(clock::now() - start).count();
+        double pixels = double(camera.width) * camera.height;
+
+        cout << "mesh " << m << ": " << tris << " triangles, " << mesh.nodes.size() << " BVH nodes, "
+             << double(bytes) / max<size_t>(tris, 1) << " bytes/triangle ("
+             << sizeof(Triangle) << " B triangle + " << sizeof(BVHNode) << " B node)" << endl;
+        cout << "  per primary ray: " << stats.nodeVisits / pixels << " node visits, "
+             << stats.triangleTests / pixels << " triangle tests, " << meshSeconds / pixels * 1e9 << " ns, "
+             << hits / pixels * 100 << "% hit" << endl;
+    }
+
+    for (size_t s = 0; s < scene.sdfs.size(); ++s) {
+        TraversalStats stats;
+        unsigned long long entered = 0, hits = 0;
+        for (int y = 0; y < camera.height; y++) {
+            for (int x = 0; x < camera.width; x++) {
+                Ray ray = camera.primaryRay(x, y);
+                if (scene.sdfs[s].bounds.intersect(ray)) ++entered;
+                if (scene.sdfs[s].intersect(ray, &stats)) ++hits;
+            }
+        }
+        double pixels = double(camera.width) * camera.height;
+        cout << "sdf " << s << ": " << scene.sdfs[s].nodeCount << " nodes, " << entered / pixels * 100 << "% of rays enter bounds, "
+             << double(stats.sdfSteps) / max<unsigned long long>(entered, 1) << " steps per entering ray, " << hits / pixels * 100 << "% hit" << endl;
+    }
+}
+
+// runtime frame times from one thread up to maxThreads (doubling), each on a plain pool and on a
+// pinned one with per-node scene replicas and node-local framebuffer bands; speedups are
+// against the same pool kind on one thread
+void scalingBenchmark(const RuntimeScene &scene, const Camera &camera, int frames, unsigned maxThreads) {
+    CpuTopology topology = CpuTopology::detect();
+    cout << topology.nodes.size() << " NUMA nodes:";
+    for (size_t n = 0; n < topology.nodes.size(); ++n) cout << " node " << topology.ids[n] << " has " << topology.nodes[n].size() << " cpus" << (n + 1 < topology.nodes.size() ? "," : "");
+    cout << endl;
+
+    double single[2] = { 0, 0 };
+    span<const Camera> view(&camera, 1);
+    for (unsigned threads = 1; ; threads = min(threads * 2, maxThreads)) {
+        double ms[2];
+        unsigned nodes = 1;
+        for (int pinned = 0; pinned < 2; ++pinned) {
+            ThreadPool pool(threads, pinned);
+            PreparedScene prepared(scene, camera);
+            if (pinned) replicatePerNode(prepared, pool), nodes = min(pool.nodes(), threads);
+            TileCosts heatmap;
+            renderViews(prepared, view, pool, nullptr, &heatmap); // warms caches and measures tile costs
+            auto start = chrono::steady_clock::now();
+            for (int frame = 0; frame < frames; ++frame) renderViews(prepared, view, pool, nullptr, &heatmap);
+            ms[pinned] = chrono::duration<double, milli>(chrono::steady_clock::now() - start).count() / frames;
+            if (threads == 1) single[pinned] = ms[pinned];
+        }
+        cout << threads << " threads on " << nodes << " nodes: plain " << ms[0] << " ms/frame (" << single[0] / ms[0] << "x), pinned "
+             << ms[1] << " ms/frame (" << single[1] / ms[1] << "x)" << endl;
+        if (threads >= maxThreads) break;
+    }
+}
+
+// transient per-frame memory. An Arena hands out bump allocations from blocks it keeps across
+// rewinds, a FixedPool recycles equally sized items through a free list; both only call malloc
+// while a frame needs more than any frame before it. Each thread has its own (local()).
+class Arena {
+public:
+    static constexpr size_t BLOCK = 1 << 16;
+
+    // restores the arena to where it was when the mark was taken
+    class Mark {
+    public:
+        explicit Mark(Arena &arena) : arena(arena), block(arena.current), used(arena.used) {}
+        ~Mark() { arena.current = block, arena.used = used; }
+    private:
+        Arena &arena;
+        size_t block, used;
+    };
+
+    static Arena& local() {
+        thread_local Arena arena;
+        return arena;
+    }
+
+    void* allocate(size_t bytes, size_t alignment) {
+        while (true) {
+            if (current < blocks.size()) {
+                uintptr_t base = uintptr_t(blocks[current].first.get());
+                uintptr_t start = (base + used + alignment - 1) / alignment * alignment;
+                if (start + bytes <= base + blocks[current].second) {
+                    used = start + bytes - base;
+                    return reinterpret_cast<void*>(start);
+                }
+                if (current + 1 < blocks.size()) {
+                    ++current, used = 0;
+                    continue;
+                }
+            }
+            // blocks too small for this request stay behind, they are reused after the next rewind
+            size_t size = max(BLOCK, bytes + alignment);
+            blocks.emplace_back(make_unique_for_overwrite<char[]>(size), size);
+            current = blocks.size() - 1, used = 0;
+        }
+    }
+
+    // value-initialized; arena memory is never destroyed, only rewound
+    template <typename T>
+    span<T> array(size_t count) {
+        static_assert(is_trivially_destructible_v<T>);
+        T* items = static_cast<T*>(allocate(count * sizeof(T), alignof(T)));
+        uninitialized_value_construct_n(items, count);
+        return span<T>(items, count);
+    }
+
+    size_t reserved() const {
+        size_t bytes = 0;
+        for (const auto &block : blocks) bytes += block.second;
+        return bytes;
+    }
+
+private:
+    vector<pair<unique_ptr<char[]>, size_t>> blocks;
+    size_t current = 0, used = 0;
+};
+
+// lets standard containers grow inside an arena; their old buffers are reclaimed by the next rewind
+template <typename T>
+struct ArenaAllocator {
+    using value_type = T;
+
+    Arena* arena;
+
+    explicit ArenaAllocator(Arena &arena) : arena(&arena) {}
+    template <typename U>
+    ArenaAllocator(const ArenaAllocator<U> &other) : arena(other.arena) {}
+
+    T* allocate(size_t count) { return static_cast<T*>(arena->allocate(count * sizeof(T), alignof(T))); }
+    void deallocate(T*, size_t) {}
+
+    template <typename U>
+    bool operator==(const ArenaAllocator<U> &other) const { return arena == other.arena; }
+};
+
+template <typename T, size_t SLAB = 64>
+class FixedPool {
+public:
+    static FixedPool& local() {
+        thread_local FixedPool pool;
+        return pool;
+    }
+
+    T* acquire() {
+        if (!available) {
+            slabs.push_back(make_unique_for_overwrite<Node[]>(SLAB));
+            for (size_t i = 0; i < SLAB; ++i) slabs.back()[i].next = i + 1 < SLAB ? &slabs.back()[i + 1] : nullptr;
+            available = &slabs.back()[0];
+        }
+        Node* node = available;
+        available = node->next;
+        ++inUse;
+        return new (node->storage) T();
+    }
+
+    void release(T* item) {
+        static_assert(is_trivially_destructible_v<T>);
+        Node* node = reinterpret_cast<Node*>(item);
+        node->next = available;
+        available = node;
+        --inUse;
+    }
+
+    size_t capacity() const { return slabs.size() * SLAB; }
+    size_t acquired() const { return inUse; }
+
+private:
+    union Node {
+        Node* next;
+        alignas(T) unsigned char storage[sizeof(T)];
+    };
+
+    vector<unique_ptr<Node[]>> slabs;
+    Node* available = nullptr;
+    size_t inUse = 0;
+};
+
+// kernel-reported huge pages backing this process's anonymous memory, in KiB
+size_t anonHugePagesKiB() {
+    ifstream rollup("/proc/self/smaps_rollup");
+    for (string line; getline(rollup, line);) {
+        if (line.rfind("AnonHugePages:", 0) == 0) return stoul(line.substr(14));
+    }
+    return 0;
+}
+
+// the runtime frame at 4x the width and height in each page mode. Mesh triangles and BVHs are
+// copied and the framebuffers allocated in that mode; one thread renders, so the hardware
+// counters see the whole frame. Meshes only move to huge pages from 2 MiB up (--obj).
+void hugePageBenchmark(const RuntimeScene &scene, const Camera &camera, int frames) {
+    Camera large = camera;
+    large.width *= 4, large.height *= 4;
+    large.invWidth = 1.f / large.width, large.invHeight = 1.f / large.height;
+    span<const Camera> view(&large, 1);
+    double rays = double(large.width) * large.height * frames;
+
+    PageMode previous = HugePages::mode;
+    const pair<PageMode, const char*> modes[] = { { PageMode::Small, "4 KiB pages" }, { PageMode::Transparent, "transparent huge pages" },
+                                                  { PageMode::Explicit, "explicit huge pages" } };
+    ThreadPool pool(1);
+    for (const auto &[mode, name] : modes) {
+        HugePages::mode = mode;
+        size_t explicitBefore = HugePages::explicitBytes, transparentBefore = HugePages::transparentBytes;
+        RuntimeScene copy = scene;
+        for (RuntimeMesh &mesh : copy.meshes) mesh = mesh.relocated();
+        PreparedScene prepared(copy, large);
+        TileCosts heatmap;
+        renderViews(prepared, view, pool, nullptr, &heatmap); // warms caches and measures tile costs
+
+        PerfCounters counters;
+        if (counters.available()) counters.start();
+        auto start = chrono::steady_clock::now();
+        for (int frame = 0; frame < frames; ++frame) renderViews(prepared, view, pool, nullptr, &heatmap);
+        double seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+        CounterValues c = counters.available() ? counters.stop() : CounterValues{};
+
+        cout << name << ": " << seconds * 1000 / frames << " ms/frame, " << rays / seconds * 1e-6 << " Mrays/s, ";
+        if (counters.counts(PerfCounters::DtlbMisses)) cout << double(c.dtlbMisses) / rays << " dTLB misses/ray, ";
+        if (counters.available()) cout << double(c.cycles) / rays << " cycles/ray, ";
+        cout << ((HugePages::explicitBytes - explicitBefore) >> 20) << " MiB explicit, " << ((HugePages::transparentBytes - transparentBefore) >> 20)
+             << " MiB advised, " << (anonHugePagesKiB() >> 10) << " MiB AnonHugePages" << endl;
+    }
+    HugePages::mode = previous;
+    PerfCounters probe;
+    if (!probe.available()) cout << "hardware counters unavailable (" << probe.unavailableReason() << "), no TLB misses" << endl;
+    else if (!probe.counts(PerfCounters::DtlbMisses)) cout << "no dTLB miss event on this CPU, no TLB misses" << endl;
+}
+
+// out-of-core sphere scenes: the file holds a small top-level BVH over treelets
+// (median-split subtrees of at most TREELET_SPHERES spheres with their own BVH),
+// each treelet starts on a page boundary so it can be paged in and dropped on its own
+//
+// layout: TreeletFileHeader, BVHNode[topNodeCount], TreeletInfo[treeletCount],
+//         then per treelet BVHNode[nodeCount] followed by Sphere[sphereCount]
+
+constexpr size_t TREELET_SPHERES = 4096;
+constexpr size_t TREELET_ALIGNMENT = 4096; // part of the file format, not the page size of the machine reading it
+constexpr char TREELET_MAGIC[8] = "RTTLET1";
+
+struct TreeletFileHeader {
+    char magic[8];
+    uint64_t sphereCount;
+    uint32_t treeletCount;
+    uint32_t topNodeCount;
+};
+
+struct TreeletInfo {
+    AABB box;
+    uint64_t offset;
+    uint64_t bytes;
+    uint32_t nodeCount;
+    uint32_t sphereCount;
+
+    constexpr AABB bounds() const { return box; }
+    constexpr vec3 centroid() const { return (box.lo + box.hi) * 0.5f; }
+};
+
+constexpr size_t alignUp(size_t n, size_t alignment) { return (n + alignment - 1) / alignment * alignment; }
+
+void splitTreelets(vector<Sphere> &spheres, size_t first, size_t count, vector<pair<size_t, size_t>> &ranges) {
+    if (count <= TREELET_SPHERES) {
+        ranges.push_back({ first, count });
+        return;
+    }
+
+    AABB centroids;
+    for (size_t i = first; i < first + count; ++i) centroids.grow(spheres[i].center);
+    int axis = centroids.longestAxis();
+    size_t mid = first + count / 2;
+    nth_element(spheres.begin() + first, spheres.begin() + mid, spheres.begin() + first + count,
+                [axis](const Sphere &a, const Sphere &b) { return a.center[axis] < b.center[axis]; });
+
+    splitTreelets(spheres, first, mid - first, ranges);
+    splitTreelets(spheres, mid, first + count - mid, ranges);
+}
+
+// reads "x y z radius [r g b]" lines, the build itself is in-core
+void buildTreelets(const string &input, const string &output) {
+    ifstream infile(input);
+    if (!infile) throw runtime_error("cannot open " + input);
+
+    vector<Sphere> spheres;
+    for (string line; getline(infile, line);) {
+        istringstream fields(line);
+        vec3 center, color(0.75);
+        float radius;
+        if (!(fields >> center.x >> center.y >> center.z >> radius)) continue;
+        fields >> color.x >> color.y >> color.z;
+        spheres.push_back(Sphere(center, radius, color, Diffuse));
+    }
+
+    vector<pair<size_t, size_t>> ranges;
+    if (!spheres.empty()) splitTreelets(spheres, 0, spheres.size(), ranges);
+
+    vector<TreeletInfo> treelets(ranges.size());
+    vector<BVHNode> topNodes(2 * ranges.size());
+    size_t offset = alignUp(sizeof(TreeletFileHeader) + topNodes.size() * sizeof(BVHNode) + treelets.size() * sizeof(TreeletInfo), TREELET_ALIGNMENT);
+
+    ofstream outfile(output, ios::out | ios::binary);
+    for (size_t t = 0; t < ranges.size(); ++t) {
+        auto [first, count] = ranges[t];
+        vector<Sphere> local(spheres.begin() + first, spheres.begin() + first + count);
+        vector<BVHNode> nodes(2 * count);
+        unsigned nodeCount = 0;
+        buildBVH(span(local), span(nodes), nodeCount, 0, count);
+
+        TreeletInfo &info = treelets[t];
+        info.box = nodes[0].bounds;
+        info.offset = offset;
+        info.nodeCount = nodeCount;
+        info.sphereCount = count;
+        info.bytes = nodeCount * sizeof(BVHNode) + count * sizeof(Sphere);
+
+        outfile.seekp(offset);
+        outfile.write(reinterpret_cast<const char*>(nodes.data()), nodeCount * sizeof(BVHNode));
+        outfile.write(reinterpret_cast<const char*>(local.data()), count * sizeof(Sphere));
+        offset = alignUp(offset + info.bytes, TREELET_ALIGNMENT);
+    }
+
+    unsigned topNodeCount = 0;
+    if (!treelets.empty()) buildBVH(span(treelets), span(topNodes), topNodeCount, 0, treelets.size(), 1);
+
+    TreeletFileHeader header{};
+    copy(begin(TREELET_MAGIC), end(TREELET_MAGIC), header.magic);
+    header.sphereCount = spheres.size();
+    header.treeletCount = treelets.size();
+    header.topNodeCount = topNodeCount;
+
+    outfile.seekp(0);
+    outfile.write(reinterpret_cast<const char*>(&header), sizeof(header));
+    outfile.write(reinterpret_cast<const char*>(topNodes.data()), topNodeCount * sizeof(BVHNode));
+    outfile.write(reinterpret_cast<const char*>(treelets.data()), treelets.size() * sizeof(TreeletInfo));
+    if (!outfile) throw runtime_error("cannot write " + output);
+
+    // offset includes the alignment padding after the last treelet, which is never written
+    outfile.seekp(0, ios::end);
+    cout << spheres.size() << " spheres in " << treelets.size() << " treelets, " << outfile.tellp() << " bytes" << endl;
+}
+
+struct StreamStats {
+    size_t treeletLoads = 0;
+    size_t bytesPaged = 0;
+    size_t peakResidentBytes = 0;
+    size_t raysQueued = 0;
+};
+
+// read-only mapping of a whole file
+class MappedFile {
+public:
+    explicit MappedFile(const string &fileName, int advice = MADV_SEQUENTIAL) {
+        fd = open(fileName.c_str(), O_RDONLY);
+        if (fd < 0) throw runtime_error("cannot open " + fileName);
+        struct stat st;
+        if (fstat(fd, &st) != 0) {
+            close(fd);
+            throw runtime_error("cannot stat " + fileName);
+        }
+        size = st.st_size;
+        void* mapping = size ? mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0) : nullptr;
+        if (mapping == MAP_FAILED) {
+            close(fd);
+            throw runtime_error("cannot map " + fileName);
+        }
+        base = static_cast<const char*>(mapping);
+        madvise(const_cast<char*>(base), size, advice);
+    }
+
+    ~MappedFile() {
+        if (base) munmap(const_cast<char*>(base), size);
+        close(fd);
+    }
+
+    MappedFile(const MappedFile &) = delete;
+    MappedFile& operator=(const MappedFile &) = delete;
+
+    const char* data() const { return base; }
+    size_t bytes() const { return size; }
+
+private:
+    int fd = -1;
+    const char* base = nullptr;
+    size_t size = 0;
+};
+
+// a BVH read from a file is only traversed once every node reachable from the root keeps
+// its indices inside the arrays and its depth inside the traversal stack; buildBVH always
+// places children after their parent, which also rules out cycles
+bool validBVH(span<const BVHNode> nodes, size_t primitives) {
+    vector<unsigned> depth(nodes.size()); // 0 = unreachable, otherwise depth + 1
+    if (!nodes.empty()) depth[0] = 1;
+    for (size_t i = 0; i < nodes.size(); ++i) {
+        const BVHNode &node = nodes[i];
+        if (depth[i] == 0) continue;
+        if (node.count > 0) {
+            if (node.first > primitives || node.count > primitives - node.first) return false;
+            continue;
+        }
+        if (node.first <= i + 1 || node.first >= nodes.size() || depth[i] + 1 >= BVH_STACK_SIZE) return false;
+        depth[i + 1] = max(depth[i + 1], depth[i] + 1);
+        depth[node.first] = max(depth[node.first], depth[i] + 1);
+    }
+    return true;
+}
+
+// memory-mapped treelet file, at most residentBudget bytes of treelets stay mapped in
+class TreeletScene {
+public:
+    TreeletScene(const string &fileName, size_t residentBudget)
+        : file(fileName, MADV_RANDOM), base(file.data()), size(file.bytes()), budget(residentBudget) {
+        const auto* header = reinterpret_cast<const TreeletFileHeader*>(base);
+        if (size < sizeof(TreeletFileHeader) || string_view(header->magic, sizeof(header->magic)) != string_view(TREELET_MAGIC, sizeof(TREELET_MAGIC)))
+            throw runtime_error(fileName + " is not a treelet file");
+
+        uint64_t tableBytes = sizeof(TreeletFileHeader) + uint64_t(header->topNodeCount) * sizeof(BVHNode) + uint64_t(header->treeletCount) * sizeof(TreeletInfo);
+        if (tableBytes > size) throw runtime_error(fileName + " is truncated");
+        top = span(reinterpret_cast<const BVHNode*>(header + 1), header->topNodeCount);
+        treelets = span(reinterpret_cast<const TreeletInfo*>(top.data() + top.size()), header->treeletCount);
+        if ((!treelets.empty() && top.empty()) || !validBVH(top, treelets.size())) throw runtime_error(fileName + " has a malformed top-level BVH");
+
+        for (const TreeletInfo &tl : treelets) {
+            uint64_t bytes = uint64_t(tl.nodeCount) * sizeof(BVHNode) + uint64_t(tl.sphereCount) * sizeof(Sphere);
+            if (tl.offset < tableBytes || tl.offset % alignof(Sphere) != 0 || tl.offset > size || tl.bytes != bytes || tl.bytes > size - tl.offset)
+                throw runtime_error(fileName + " has a treelet outside the file");
+        }
+        checked.resize(treelets.size());
+    }
+
+    size_t treeletCount() const { return treelets.size(); }
+    const TreeletInfo& info(size_t t) const { return treelets[t]; }
+
+    // treelets whose bounds the ray enters before tmax
+    template <typename Out>
+    void treeletsHit(const Ray &ray, float tmax, Out &out) const {
+        if (treelets.empty()) return;
+        vec3 invDir = inverseDirection(ray.dir);
+        array<unsigned, BVH_STACK_SIZE> stack{};
+        int top_ = 0;
+        stack[top_++] = 0;
+        while (top_ > 0) {
+            const BVHNode &node = top[stack[--top_]];
+            if (!node.bounds.hit(ray, invDir, tmax)) continue;
+            if (node.count == 0) {
+                stack[top_++] = node.first;
+                stack[top_++] = &node - top.data() + 1;
+            } else {
+                for (unsigned i = node.first; i < node.first + node.count; ++i) out.push_back(i);
+            }
+        }
+    }
+
+    pair<span<const BVHNode>, span<const Sphere>> page(uint32_t t) {
+        const TreeletInfo &tl = treelets[t];
+        if (auto it = find(resident.begin(), resident.end(), t); it != resident.end()) {
+            resident.erase(it);
+        } else {
+            while (!resident.empty() && residentBytes + tl.bytes > budget) evict();
+            madvise(const_cast<char*>(base) + tl.offset, tl.bytes, MADV_WILLNEED);
+            if (!checked[t] && !validBVH(treeletNodes(tl), tl.sphereCount)) throw runtime_error("treelet " + to_string(t) + " has a malformed BVH");
+            checked[t] = true;
+            residentBytes += tl.bytes;
+            stats.treeletLoads++;
+            stats.bytesPaged += tl.bytes;
+            stats.peakResidentBytes = max(stats.peakResidentBytes, residentBytes);
+        }
+        resident.push_back(t); // most recently used last
+
+        span<const BVHNode> nodes = treeletNodes(tl);
+        return { nodes, span(reinterpret_cast<const Sphere*>(nodes.data() + nodes.size()), tl.sphereCount) };
+    }
+
+    StreamStats stats;
+
+private:
+    span<const BVHNode> treeletNodes(const TreeletInfo &tl) const {
+        return span(reinterpret_cast<const BVHNode*>(base + tl.offset), tl.nodeCount);
+    }
+
+    // on kernels with pages larger than TREELET_ALIGNMENT the range also drops the edges of
+    // neighbouring treelets; the mapping is read only, they fault back in from the file
+    void evict() {
+        const TreeletInfo &tl = treelets[resident.front()];
+        size_t page = sysconf(_SC_PAGESIZE);
+        size_t begin = tl.offset / page * page;
+        madvise(const_cast<char*>(base) + begin, min(alignUp(tl.offset + tl.bytes, page), alignUp(size, page)) - begin, MADV_DONTNEED);
+        residentBytes -= tl.bytes;
+        resident.erase(resident.begin());
+    }
+
+    MappedFile file;
+    const char* base;
+    size_t size;
+    size_t budget;
+    size_t residentBytes = 0;
+    span<const BVHNode> top;
+    span<const TreeletInfo> treelets;
+    vector<bool> checked; // treelet BVHs are validated on their first page-in
+    vector<uint32_t> resident;
+};
+
+struct StreamRay {
+    Ray ray;
+    float tmax;
+    bool found = false;
+    Sphere sphere; // copied out, the treelet it came from may be evicted
+};
+
+// a treelet's queued rays, in packets from the thread's FixedPool
+struct RayPacket {
+    static constexpr uint32_t CAPACITY = 253; // 1 KiB per packet
+
+    RayPacket* next;
+    uint32_t count;
+    uint32_t rays[CAPACITY];
+};
+
+struct RayQueue {
+    RayPacket *head, *tail;
+    size_t size;
+
+    void push(FixedPool<RayPacket> &packets, uint32_t ray) {
+        if (!tail || tail->count == RayPacket::CAPACITY) {
+            RayPacket* packet = packets.acquire();
+            (tail ? tail->next : head) = packet;
+            tail = packet;
+        }
+        tail->rays[tail->count++] = ray;
+        size++;
+    }
+};
+
+// queues every ray on the treelets it enters, then visits the queues in file order
+// so each treelet is paged in once per batch and intersected with all its rays.
+// Queues and scratch live in the thread's arena, packets go back to the pool as soon
+// as their treelet is done.
+template <bool AnyHit>
+void traceBatch(TreeletScene &scene, span<StreamRay> rays) {
+    Instrument::Scope scope("trace batch");
+    Arena &arena = Arena::local();
+    Arena::Mark mark(arena);
+    FixedPool<RayPacket> &packets = FixedPool<RayPacket>::local();
+
+    span<RayQueue> queues = arena.array<RayQueue>(scene.treeletCount());
+    vector<uint32_t, ArenaAllocator<uint32_t>> hit{ ArenaAllocator<uint32_t>(arena) };
+    hit.reserve(64);
+    for (uint32_t r = 0; r < rays.size(); ++r) {
+        hit.clear();
+        scene.treeletsHit(rays[r].ray, rays[r].tmax, hit);
+        for (uint32_t t : hit) queues[t].push(packets, r);
+    }
+
+    span<uint32_t> order = arena.array<uint32_t>(scene.treeletCount());
+    for (uint32_t t = 0; t < order.size(); ++t) order[t] = t;
+    sort(order.begin(), order.end(), [&](uint32_t a, uint32_t b) { return scene.info(a).offset < scene.info(b).offset; });
+
+    for (uint32_t t : order) {
+        if (!queues[t].head) continue;
+        auto [nodes, spheres] = scene.page(t);
+        scene.stats.raysQueued += queues[t].size;
+        for (RayPacket* packet = queues[t].head; packet;) {
+            for (uint32_t i = 0; i < packet->count; ++i) {
+                StreamRay &sr = rays[packet->rays[i]];
+                if (AnyHit && sr.found) continue;
+                if (auto inter = traverseBVH<AnyHit>(sr.ray, spheres, nodes, sr.tmax, nullptr); inter) {
+                    sr.tmax = inter->t;
+                    sr.sphere = *inter->primitive;
+                    sr.found = true;
+                }
+            }
+            RayPacket* done = packet;
+            packet = packet->next;
+            packets.release(done);
+        }
+    }
+}
+
+// the ray and normal buffers are frame data in the arena, the shadow buffer is reused per light
+template <typename Lights>
+Canvas renderOutOfCore(TreeletScene &scene, const Lights &lights, const vec3 &background, const Camera &camera) {
+    Arena &arena = Arena::local();
+    Arena::Mark frame(arena);
+    size_t pixels = size_t(camera.width) * camera.height;
+    span<StreamRay> primary = arena.array<StreamRay>(pixels);
+    for (int y = 0; y < camera.height; y++) {
+        for (int x = 0; x < camera.width; x++) {
+            primary[size_t(y) * camera.width + x].ray = camera.primaryRay(x, y);
+            primary[size_t(y) * camera.width + x].tmax = INF;
+        }
+    }
+    traceBatch<false>(scene, primary);
+
+    // same diffuse shading as trace(), with one batch of shadow rays per light
+    Canvas canvas(camera.width, camera.height);
+    span<vec3> normals = arena.array<vec3>(pixels);
+    for (size_t p = 0; p < primary.size(); ++p) {
+        const StreamRay &sr = primary[p];
+        if (!sr.found) {
+            canvas.pixels[p] = background;
+            continue;
+        }
+        vec3 pointHit = sr.ray.orig + sr.ray.dir * sr.tmax;
+        normals[p] = pointHit - sr.sphere.center;
+        normals[p].normalize();
+        if (sr.ray.dir.dot(normals[p]) > 0) normals[p] = -normals[p];
+    }
+
+    span<StreamRay> shadow = arena.array<StreamRay>(pixels);
+    for (const Light &light : lights) {
+        fill(shadow.begin(), shadow.end(), StreamRay{});
+        for (size_t p = 0; p < primary.size(); ++p) {
+            if (!primary[p].found) continue;
+            vec3 pointHit = primary[p].ray.orig + primary[p].ray.dir * primary[p].tmax;
+            vec3 lightDirection = light.position - pointHit;
+            shadow[p].tmax = lightDirection.magnitude();
+            shadow[p].ray = Ray(pointHit + normals[p], lightDirection.normalize());
+        }
+        traceBatch<true>(scene, shadow);
+
+        for (size_t p = 0; p < primary.size(); ++p) {
+            if (!primary[p].found || shadow[p].found) continue;
+            canvas.pixels[p] += primary[p].sphere.color * max(float(0), normals[p].dot(shadow[p].ray.dir)) * light.color;
+        }
+    }
+    return canvas;
+}
+
+// multi-process tile farm: forked workers claim tiles from a queue in shared memory and write
+// into a shared framebuffer. A tile's state is TILE_FREE, TILE_DONE or 2 + the slot of the
+// worker drawing it, so when a worker dies its unfinished tiles go back to the queue and a
+// replacement is forked under a new slot. Workers inherit the prepared scene copy-on-write.
+constexpr uint32_t TILE_FREE = 0, TILE_DONE = 1;
+constexpr int FARM_TILE = 16;
+constexpr uint32_t MAX_FARM_SLOTS = 64; // respawns stop here, the coordinator draws what is left
+
+struct FarmStats {
+    size_t reassigned = 0, respawned = 0;
+    vector<uint32_t> tilesPerSlot; // the last entry counts tiles drawn by the coordinator
+};
+
+Canvas renderTileFarm(const PreparedScene &prepared, const Camera &camera, unsigned workers, FarmStats &stats, int killSlot = -1) {
+    int tilesX = (camera.width + FARM_TILE - 1) / FARM_TILE, tilesY = (camera.height + FARM_TILE - 1) / FARM_TILE;
+    uint32_t tileCount = tilesX * tilesY;
+    size_t pixelCount = size_t(camera.width) * camera.height;
+
+    // cursor, per-slot tile counts, tile states, then the framebuffer
+    size_t counters = 1 + (MAX_FARM_SLOTS + 1) + tileCount;
+    size_t bytes = counters * sizeof(atomic<uint32_t>) + pixelCount * sizeof(vec3);
+    void* shared = mmap(nullptr, bytes, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (shared == MAP_FAILED) throw runtime_error("cannot map the farm's shared memory");
+    auto* slots = static_cast<atomic<uint32_t>*>(shared);
+    for (size_t i = 0; i < counters; ++i) new (&slots[i]) atomic<uint32_t>(0);
+    atomic<uint32_t> &cursor = slots[0];
+    atomic<uint32_t>* tilesDrawn = slots + 1;
+    atomic<uint32_t>* states = tilesDrawn + MAX_FARM_SLOTS + 1;
+    vec3* pixels = reinterpret_cast<vec3*>(states + tileCount);
+
+    FrameContext frame = prepared.frame();
+    auto work = [&](uint32_t slot) {
+        auto claimAndDraw = [&](uint32_t tile) {
+            uint32_t expected = TILE_FREE;
+            if (!states[tile].compare_exchange_strong(expected, 2 + slot)) return;
+            if (int(slot) == killSlot) raise(SIGKILL);
+
+            int x0 = tile % tilesX * FARM_TILE, y0 = tile / tilesX * FARM_TILE;
+            for (int y = y0; y < min(y0 + FARM_TILE, camera.height); ++y) {
+                for (int x = x0; x < min(x0 + FARM_TILE, camera.width); ++x) {
+                    pixels[size_t(y) * camera.width + x] = trace(camera.primaryRay(x, y), prepared.primary, prepared.shadow, frame, 0);
+                }
+            }
+            states[tile] = TILE_DONE;
+            tilesDrawn[slot]++;
+        };
+        for (uint32_t tile = cursor++; tile < tileCount; tile = cursor++) claimAndDraw(tile);
+        for (uint32_t tile = 0; tile < tileCount; ++tile) claimAndDraw(tile); // put back after a crash
+    };
+
+    map<pid_t, uint32_t> running;
+    uint32_t nextSlot = 0;
+    auto spawn = [&] {
+        uint32_t slot = nextSlot++;
+        pid_t pid = fork();
+        if (pid < 0) throw runtime_error("fork failed");
+        if (pid == 0) {
+            work(slot);
+            _exit(0);
+        }
+        running[pid] = slot;
+    };
+
+    // only the farm's own workers are reaped, other children of the process are left to their owners.
+    // A worker that can no longer be waited for counts as crashed.
+    auto reap = [&](bool &clean) {
+        while (true) {
+            for (auto worker = running.begin(); worker != running.end(); ++worker) {
+                int status;
+                pid_t pid = waitpid(worker->first, &status, WNOHANG);
+                if (pid == 0 || (pid < 0 && errno == EINTR)) continue;
+                clean = pid == worker->first && WIFEXITED(status) && WEXITSTATUS(status) == 0;
+                return worker;
+            }
+            this_thread::sleep_for(chrono::milliseconds(1));
+        }
+    };
+
+    cout.flush();
+    for (unsigned i = 0; i < max(workers, 1u); ++i) spawn();
+    while (!running.empty()) {
+        bool clean = false;
+        auto exited = reap(clean);
+        uint32_t slot = exited->second;
+        running.erase(exited);
+        if (clean) continue;
+
+        for (uint32_t tile = 0; tile < tileCount; ++tile) {
+            uint32_t expected = 2 + slot;
+            if (states[tile].compare_exchange_strong(expected, TILE_FREE)) stats.reassigned++;
+        }
+        if (nextSlot < MAX_FARM_SLOTS) {
+            spawn();
+            stats.respawned++;
+        }
+    }
+    work(MAX_FARM_SLOTS);
+
+    Canvas canvas(camera.width, camera.height);
+    copy(pixels, pixels + pixelCount, canvas.pixels.begin());
+    stats.tilesPerSlot.assign(nextSlot + 1, 0);
+    for (uint32_t slot = 0; slot < nextSlot; ++slot) stats.tilesPerSlot[slot] = tilesDrawn[slot];
+    stats.tilesPerSlot.back() = tilesDrawn[MAX_FARM_SLOTS];
+    munmap(shared, bytes);
+    return canvas;
+}
+
+// partial frames for batch farms: --tiles renders a pixel rectangle to a tile file, a header
+// plus 8-bit RGB rows quantized like save(), and --merge assembles tile files covering the
+// image. The inputs are mapped and every output row is written once, straight from the
+// mappings, either as P6 or as a PNG whose deflate stream uses stored (uncompressed) blocks.
+constexpr char TILE_MAGIC[8] = "RTTILE1";
+
+struct TileFileHeader {
+    char magic[8];
+    uint32_t imageWidth, imageHeight;
+    uint32_t x0, y0, x1, y1; // x1 and y1 exclusive
+};
+
+void renderTileFile(const PreparedScene &prepared, const Camera &camera, const TileFileHeader &rect, const string &fileName) {
+    if (rect.x0 >= rect.x1 || rect.y0 >= rect.y1 || rect.x1 > uint32_t(camera.width) || rect.y1 > uint32_t(camera.height)) {
+        throw runtime_error("tile outside the image");
+    }
+    TileFileHeader header = rect;
+    copy(begin(TILE_MAGIC), end(TILE_MAGIC), header.magic);
+    header.imageWidth = camera.width, header.imageHeight = camera.height;
+
+    FrameContext frame = prepared.frame();
+    string rgb;
+    rgb.reserve(size_t(rect.x1 - rect.x0) * (rect.y1 - rect.y0) * 3);
+    for (uint32_t y = rect.y0; y < rect.y1; ++y) {
+        for (uint32_t x = rect.x0; x < rect.x1; ++x) {
+            vec3 color = trace(camera.primaryRay(x, y), prepared.primary, prepared.shadow, frame, 0);
+            for (int c = 0; c < 3; ++c) rgb += char(int(min(color[c] * 255.0, 255.0)));
+        }
+    }
+    ofstream outfile(fileName, ios::out | ios::binary);
+    outfile.write(reinterpret_cast<const char*>(&header), sizeof(header));
+    outfile << rgb;
+    if (!outfile) throw runtime_error("cannot write " + fileName);
+}
+
+constexpr array<uint32_t, 256> crc32Table() {
+    array<uint32_t, 256> table{};
+    for (uint32_t n = 0; n < 256; ++n) {
+        uint32_t c = n;
+        for (int k = 0; k < 8; ++k) c = c & 1 ? 0xedb88320u ^ (c >> 1) : c >> 1;
+        table[n] = c;
+    }
+    return table;
+}
+
+// PNG (8-bit RGB, no filtering) streamed through one IDAT chunk of stored deflate blocks,
+// so every length is known before the first row and the rows are written in order
+class PngStreamWriter {
+public:
+    PngStreamWriter(ostream &out, uint32_t width, uint32_t height) : out(out), remaining(uint64_t(height) * (1 + 3 * uint64_t(width))) {
+        uint64_t blocks = (remaining + 65534) / 65535;
+        uint64_t idat = 2 + 5 * blocks + remaining + 4;
+        if (idat > 0x7fffffff) throw runtime_error("image too large for one PNG chunk");
+
+        out.write("\x89PNG\r\n\x1a\n", 8);
+        unsigned char ihdr[13] = {};
+        bigEndian(ihdr, width), bigEndian(ihdr + 4, height);
+        ihdr[8] = 8, ihdr[9] = 2; // bit depth, truecolor
+        chunk("IHDR", 13);
+        put(ihdr, 13);
+        endChunk();
+
+        chunk("IDAT", idat);
+        put("\x78\x01", 2);
+    }
+
+    // raw image bytes in order, a filter byte (0) in front of every row
+    void raw(const void* data, size_t bytes) {
+        auto* p = static_cast<const unsigned char*>(data);
+        while (bytes > 0) {
+            if (blockLeft == 0) {
+                blockLeft = min<uint64_t>(remaining, 65535);
+                unsigned char header[5] = { remaining == blockLeft, (unsigned char)blockLeft, (unsigned char)(blockLeft >> 8),
+                                            (unsigned char)~blockLeft, (unsigned char)(~blockLeft >> 8) };
+                put(header, 5);
+            }
+            size_t n = min<uint64_t>(bytes, blockLeft);
+            put(p, n);
+            for (size_t i = 0; i < n; ++i) {
+                adlerA += p[i], adlerB += adlerA;
+                if ((i & 4095) == 4095) adlerA %= 65521, adlerB %= 65521;
+            }
+            adlerA %= 65521, adlerB %= 65521;
+            p += n, bytes -= n, blockLeft -= n, remaining -= n;
+        }
+    }
+
+    void finish() {
+        if (remaining != 0) throw runtime_error("PNG rows incomplete");
+        unsigned char adler[4];
+        bigEndian(adler, adlerB << 16 | adlerA);
+        put(adler, 4);
+        endChunk();
+        chunk("IEND", 0);
+        endChunk();
+    }
+
+private:
+    static void bigEndian(unsigned char* p, uint32_t v) { p[0] = v >> 24, p[1] = v >> 16, p[2] = v >> 8, p[3] = v; }
+
+    void chunk(const char* type, uint32_t length) {
+        unsigned char len[4];
+        bigEndian(len, length);
+        out.write(reinterpret_cast<const char*>(len), 4);
+        crc = 0xffffffffu;
+        put(type, 4);
+    }
+
+    void endChunk() {
+        unsigned char value[4];
+        bigEndian(value, crc ^ 0xffffffffu);
+        out.write(reinterpret_cast<const char*>(value), 4);
+    }
+
+    void put(const void* data, size_t bytes) {
+        static constexpr array<uint32_t, 256> table = crc32Table();
+        auto* p = static_cast<const unsigned char*>(data);
+        for (size_t i = 0; i < bytes; ++i) crc = table[(crc ^ p[i]) & 0xff] ^ (crc >> 8);
+        out.write(reinterpret_cast<const char*>(data), bytes);
+    }
+
+    ostream &out;
+    uint64_t remaining;
+    uint64_t blockLeft = 0;
+    uint32_t crc = 0, adlerA = 1, adlerB = 0;
+};
+
+// output name ending in .png writes a PNG, anything else a P6 PPM
+int mergeTiles(const string &output, span<char* const> inputs) {
+    vector<unique_ptr<MappedFile>> files;
+    vector<const TileFileHeader*> tiles;
+    for (const char* input : inputs) {
+        files.push_back(make_unique<MappedFile>(input));
+        const MappedFile &file = *files.back();
+        auto* header = reinterpret_cast<const TileFileHeader*>(file.data());
+        if (file.bytes() < sizeof(TileFileHeader) || string_view(header->magic, sizeof header->magic) != string_view(TILE_MAGIC, sizeof TILE_MAGIC)) throw runtime_error(string(input) + " is not a tile file");
+        if (!tiles.empty() && (header->imageWidth != tiles[0]->imageWidth || header->imageHeight != tiles[0]->imageHeight)) {
+            throw runtime_error(string(input) + " belongs to a different image size");
+        }
+        if (header->x0 >= header->x1 || header->y0 >= header->y1 || header->x1 > header->imageWidth || header->y1 > header->imageHeight ||
+            file.bytes() < sizeof(TileFileHeader) + size_t(header->x1 - header->x0) * (header->y1 - header->y0) * 3) {
+            throw runtime_error(string(input) + " is truncated or malformed");
+        }
+        tiles.push_back(header);
+    }
+    if (tiles.empty()) throw runtime_error("no tiles to merge");
+    sort(tiles.begin(), tiles.end(), [](auto a, auto b) { return a->x0 < b->x0; });
+    uint32_t width = tiles[0]->imageWidth, height = tiles[0]->imageHeight;
+
+    // the spans covering row y, left to right; a dry run checks the coverage before writing
+    auto forEachSpan = [&](uint32_t y, auto &&emit) {
+        uint32_t x = 0;
+        for (const TileFileHeader* tile : tiles) {
+            if (y < tile->y0 || y >= tile->y1) continue;
+            if (tile->x0 != x) throw runtime_error("tiles leave a gap or overlap in row " + to_string(y));
+            uint32_t w = tile->x1 - tile->x0;
+            emit(reinterpret_cast<const char*>(tile + 1) + size_t(y - tile->y0) * w * 3, size_t(w) * 3);
+            x = tile->x1;
+        }
+        if (x != width) throw runtime_error("tiles do not cover row " + to_string(y));
+    };
+    for (uint32_t y = 0; y < height; ++y) forEachSpan(y, [](const char*, size_t) {});
+
+    ofstream outfile(output, ios::out | ios::binary);
+    bool png = output.size() >= 4 && output.compare(output.size() - 4, 4, ".png") == 0;
+    if (png) {
+        PngStreamWriter writer(outfile, width, height);
+        for (uint32_t y = 0; y < height; ++y) {
+            writer.raw("", 1);
+            forEachSpan(y, [&](const char* row, size_t bytes) { writer.raw(row, bytes); });
+        }
+        writer.finish();
+    } else {
+        outfile << "P6\n" << width << " " << height << "\n255\n";
+        for (uint32_t y = 0; y < height; ++y) forEachSpan(y, [&](const char* row, size_t bytes) { outfile.write(row, bytes); });
+    }
+    if (!outfile) throw runtime_error("cannot write " + output);
+    cout << "merged " << tiles.size() << " tiles into " << width << "x" << height << " " << output << endl;
+    return 0;
+}
+
+// progressive rendering: pass s adds the s-th jittered sample, Sampler(pixel, s), to every
+// pixel of a tile, so the per-tile sample counts are all the random state there is. A
+// checkpoint holds the accumulation buffer and those counts; resuming continues the same sums
+// in the same order, which makes the final image bit-identical to an uninterrupted run.
+// Checkpoints are snapshots taken between batches of tiles and written on a background thread.
+constexpr char CHECKPOINT_MAGIC[8] = "RTCKPT1";
+constexpr int PROGRESSIVE_TILE = 16;
+
+struct CheckpointHeader {
+    char magic[8];
+    uint64_t renderKey; // scene, camera and settings, a checkpoint only resumes the same render
+    uint32_t width, height;
+    uint32_t tileSize, samples;
+};
+
+class ProgressiveRenderer {
+public:
+    ProgressiveRenderer(const PreparedScene &prepared, const Camera &camera, uint32_t samples, uint64_t renderKey) :
+                        prepared(prepared), camera(camera), tilesX((camera.width + PROGRESSIVE_TILE - 1) / PROGRESSIVE_TILE),
+                        tilesY((camera.height + PROGRESSIVE_TILE - 1) / PROGRESSIVE_TILE),
+                        header{ {}, renderKey, uint32_t(camera.width), uint32_t(camera.height), PROGRESSIVE_TILE, samples },
+                        tileSamples(size_t(tilesX) * tilesY, 0), accumulated(size_t(camera.width) * camera.height) {
+        copy(begin(CHECKPOINT_MAGIC), end(CHECKPOINT_MAGIC), header.magic);
+    }
+
+    ~ProgressiveRenderer() {
+        if (writer.joinable()) writer.join();
+    }
+
+    // false if there is no checkpoint yet, throws if it belongs to a different render
+    bool resume(const string &fileName) {
+        ifstream infile(fileName, ios::in | ios::binary);
+        if (!infile) return false;
+        CheckpointHeader saved;
+        infile.read(reinterpret_cast<char*>(&saved), sizeof(saved));
+        if (!infile || string_view(saved.magic, sizeof saved.magic) != string_view(CHECKPOINT_MAGIC, sizeof CHECKPOINT_MAGIC) || saved.renderKey != header.renderKey || saved.width != header.width ||
+            saved.height != header.height || saved.tileSize != header.tileSize || saved.samples != header.samples) {
+            throw runtime_error(fileName + " is not a checkpoint of this render");
+        }
+        infile.read(reinterpret_cast<char*>(tileSamples.data()), tileSamples.size() * sizeof(uint32_t));
+        infile.read(reinterpret_cast<char*>(accumulated.data()), accumulated.size() * sizeof(vec3));
+        if (!infile) throw runtime_error(fileName + " is truncated");
+        return true;
+    }
+
+    // renders the missing samples tile by tile, pass by pass
+    void run(ThreadPool &pool, const string &checkpointFile, double checkpointSeconds) {
+        using clock = chrono::steady_clock;
+        FrameContext frame = prepared.frame();
+        auto lastCheckpoint = clock::now();
+        vector<uint32_t> pending;
+        for (uint32_t pass = 0; pass < header.samples; ++pass) {
+            pending.clear();
+            for (uint32_t tile = 0; tile < tileSamples.size(); ++tile) {
+                if (tileSamples[tile] == pass) pending.push_back(tile);
+            }
+            for (size_t first = 0; first < pending.size(); first += 4 * pool.size()) {
+                size_t count = min<size_t>(4 * pool.size(), pending.size() - first);
+                pool.run(count, [&](size_t i) { addSample(pending[first + i], pass, frame); });
+
+                if (!checkpointFile.empty() && clock::now() - lastCheckpoint >= chrono::duration<double>(checkpointSeconds)) {
+                    checkpoint(checkpointFile);
+                    lastCheckpoint = clock::now();
+                }
+            }
+        }
+        if (!checkpointFile.empty()) checkpoint(checkpointFile);
+        collectWrite();
+    }
+
+    Canvas image() const {
+        Canvas canvas(camera.width, camera.height);
+        for (int y = 0; y < camera.height; ++y) {
+            for (int x = 0; x < camera.width; ++x) {
+                uint32_t samples = tileSamples[size_t(y / PROGRESSIVE_TILE) * tilesX + x / PROGRESSIVE_TILE];
+                canvas.set_pixel(x, y, accumulated[size_t(y) * camera.width + x] * (samples ? 1.f / samples : 0.f));
+            }
+        }
+        return canvas;
+    }
+
+    size_t checkpointsWritten() const { return checkpoints; }
+    size_t checkpointsFailed() const { return failures; }
+
+    // share of the samples already accumulated, tiles weigh the same
+    double completed() const {
+        uint64_t done = 0;
+        for (uint32_t samples : tileSamples) done += samples;
+        return double(done) / max(double(tileSamples.size()) * header.samples, 1.0);
+    }
+
+private:
+    void addSample(uint32_t tile, uint32_t pass, const FrameContext &frame) {
+        int x0 = tile % tilesX * PROGRESSIVE_TILE, y0 = tile / tilesX * PROGRESSIVE_TILE;
+        for (int y = y0; y < min(y0 + PROGRESSIVE_TILE, camera.height); ++y) {
+            for (int x = x0; x < min(x0 + PROGRESSIVE_TILE, camera.width); ++x) {
+                Sampler sampler(uint32_t(y) * camera.width + x, pass);
+                float dx = sampler.next(), dy = sampler.next(), lu = sampler.next(), lv = sampler.next();
+                accumulated[size_t(y) * camera.width + x] += trace(camera.lensRay(x + dx, y + dy, lu, lv), prepared.primary, prepared.shadow, frame, 0);
+            }
+        }
+        tileSamples[tile]++;
+    }
+
+    // the snapshot is copied here, the previous write finishes first so files land in order
+    void checkpoint(const string &fileName) {
+        string snapshot(reinterpret_cast<const char*>(&header), sizeof(header));
+        snapshot.append(reinterpret_cast<const char*>(tileSamples.data()), tileSamples.size() * sizeof(uint32_t));
+        snapshot.append(reinterpret_cast<const char*>(accumulated.data()), accumulated.size() * sizeof(vec3));
+        collectWrite();
+        writer = thread([this, fileName, snapshot = std::move(snapshot)] { writeError = writeFileAtomically(fileName, snapshot); });
+    }
+
+    // waits for the previous write and counts it; a failed checkpoint leaves the last good one
+    // in place and the render goes on
+    void collectWrite() {
+        if (!writer.joinable()) return;
+        writer.join();
+        if (writeError.empty()) {
+            checkpoints++;
+            return;
+        }
+        cerr << "checkpoint failed: " << writeError << endl;
+        failures++;
+        writeError.clear();
+    }
+
+    const PreparedScene &prepared;
+    Camera camera;
+    int tilesX, tilesY;
+    CheckpointHeader header;
+    vector<uint32_t> tileSamples;
+    PageVector<vec3> accumulated;
+    thread writer;
+    string writeError; // set by the writer, read after joining it
+    size_t checkpoints = 0, failures = 0;
+};
+
+// content-addressed store of encoded frames, one <key>.ppm file each. Files are written
+// under a temporary name and renamed into place, so readers never see a partial image.
+// Hits refresh a file's modification time and stores evict the least recently used files
+// past maxBytes. Hit and miss totals over all runs are kept in <directory>/stats.
+class RenderCache {
+public:
+    struct Stats {
+        size_t hits = 0, misses = 0, evictions = 0;
+        uintmax_t bytes = 0;
+    };
+
+    RenderCache(const filesystem::path &directory, uintmax_t maxBytes) : directory(directory), maxBytes(maxBytes) {
+        filesystem::create_directories(directory);
+    }
+
+    optional<string> find(uint64_t key) {
+        filesystem::path file = path(key);
+        error_code ignored;
+        ifstream infile(file, ios::in | ios::binary);
+        if (!infile || !filesystem::is_regular_file(file, ignored)) {
+            count(false);
+            return nullopt;
+        }
+        stringstream buffer;
+        buffer << infile.rdbuf();
+        filesystem::last_write_time(file, filesystem::file_time_type::clock::now(), ignored);
+        count(true);
+        return buffer.str();
+    }
+
+    // an image larger than the whole cache would only evict everything else, it is not kept.
+    // The cache is optional: a failed write (full disk, read-only directory) is reported and the
+    // frame is not kept either.
+    bool store(uint64_t key, const string &encoded) {
+        if (encoded.size() > maxBytes) return false;
+        if (string failure = writeFileAtomically(path(key), encoded); !failure.empty()) {
+            cerr << "render cache: " << failure << endl;
+            return false;
+        }
+        evict();
+        return true;
+    }
+
+    const Stats& statistics() const { return stats; }
+
+    // totals of every run sharing the directory
+    Stats totals() const { return read(); }
+
+private:
+    filesystem::path path(uint64_t key) const {
+        char name[24];
+        snprintf(name, sizeof(name), "%016llx.ppm", (unsigned long long)key);
+        return directory / name;
+    }
+
+    // other processes may evict the same files, vanished entries are skipped
+    void evict() {
+        vector<pair<filesystem::file_time_type, filesystem::path>> files;
+        uintmax_t total = 0;
+        error_code ignored;
+        for (const auto &entry : filesystem::directory_iterator(directory, ignored)) {
+            if (entry.path().extension() != ".ppm") continue;
+            uintmax_t size = entry.file_size(ignored);
+            if (size == uintmax_t(-1)) continue;
+            total += size;
+            files.emplace_back(entry.last_write_time(ignored), entry.path());
+        }
+        sort(files.begin(), files.end());
+        for (size_t i = 0; total > maxBytes && i < files.size(); ++i) {
+            uintmax_t size = filesystem::file_size(files[i].second, ignored);
+            if (filesystem::remove(files[i].second, ignored)) total -= size, stats.evictions++;
+        }
+        stats.bytes = total;
+    }
+
+    // the totals file is rewritten under an exclusive lock
+    void count(bool hit) {
+        (hit ? stats.hits : stats.misses)++;
+        int fd = open((directory / "stats").c_str(), O_RDWR | O_CREAT, 0644);
+        if (fd < 0) return;
+        if (flock(fd, LOCK_EX) != 0) {
+            cerr << "cannot lock render cache stats" << endl;
+            close(fd);
+            return;
+        }
+        Stats total = read();
+        (hit ? total.hits : total.misses)++;
+        string line = to_string(total.hits) + " " + to_string(total.misses) + "\n";
+        if (ftruncate(fd, 0) == 0 && pwrite(fd, line.data(), line.size(), 0) < 0) cerr << "cannot update render cache stats" << endl;
+        close(fd);
+    }
+
+    Stats read() const {
+        Stats total;
+        ifstream(directory / "stats") >> total.hits >> total.misses;
+        return total;
+    }
+
+    filesystem::path directory;
+    uintmax_t maxBytes;
+    Stats stats;
+};
+
+// bump whenever a change alters runtime pixels, frames cached by other versions never match
+constexpr uint32_t ENGINE_VERSION = 1;
+
+// everything a runtime frame depends on, except a loaded irradiance cache file: frames using
+// one are never cached
+uint64_t renderKey(const RuntimeScene &scene, const Camera &camera, const ShadowMapSettings &shadowMaps, const IrradianceSettings &irradiance,
+                   bool reproducible) {
+    uint64_t sceneHash = hashScene(scene);
+    return ContentHash().field(ENGINE_VERSION).field(reproducible).field(sceneHash)
+                        .field(camera)
+                        .field(shadowMaps.resolution).field(shadowMaps.bias).field(shadowMaps.pcfRadius)
+                        .field(irradiance.samples).field(irradiance.accuracy).field(irradiance.minSpacing).field(irradiance.maxSpacing).value;
+}
+
+// render daemon: scene descriptions arrive over a Unix domain socket, built meshes and
+// prepared scenes are kept by content hash, and frames render one at a time on a shared pool,
+// highest priority first.
+//
+//   "render <priority>\n" <scene lines> "end\n"  ->  "id <n>\n", then "image <bytes>\n" <P6 data>,
+//                                                     "cancelled\n" or "error <message>\n"
+//   "cancel <n>\n"                               ->  "ok\n" or "unknown\n"
+//   "stats\n"                                    ->  one line of counters
+//
+// closing the connection before the image arrives cancels the request. Scene lines, '#' comments:
+//   background r g b
+//   light x y z r g b intensity
+//   sphere x y z radius r g b
+//   mesh <file.obj> x y z scale r g b
+//   camera x y z fov width height
+//   lookat x y z
+struct SceneDescription {
+    RuntimeScene scene;
+    Camera camera;
+};
+
+SceneDescription parseSceneDescription(const string &text, const function<RuntimeMesh(const string &, const vec3 &, float, const vec3 &)> &loadMesh) {
+    RuntimeScene scene;
+    vec3 position, target;
+    float fov = 30;
+    int width = WIDTH, height = HEIGHT;
+    bool aimed = false;
+
+    istringstream lines(text);
+    string line;
+    while (getline(lines, line)) {
+        istringstream in(line.substr(0, line.find('#')));
+        string kind;
+        if (!(in >> kind)) continue;
+
+        vec3 a, b;
+        float f = 0;
+        string file;
+        if (kind == "background" && in >> a.x >> a.y >> a.z) scene.background = a;
+        else if (kind == "light" && in >> a.x >> a.y >> a.z >> b.x >> b.y >> b.z >> f) scene.lights.push_back(Light(a, b, f));
+        else if (kind == "sphere" && in >> a.x >> a.y >> a.z >> f >> b.x >> b.y >> b.z) scene.spheres.push_back(Sphere(a, f, b, Diffuse));
+        else if (kind == "mesh" && in >> file >> a.x >> a.y >> a.z >> f >> b.x >> b.y >> b.z) scene.meshes.push_back(loadMesh(file, a, f, b));
+        else if (kind == "camera" && in >> position.x >> position.y >> position.z >> fov >> width >> height) continue;
+        else if (kind == "lookat" && in >> target.x >> target.y >> target.z) aimed = true;
+        else throw runtime_error("bad scene line: " + line);
+    }
+    if (width <= 0 || height <= 0 || int64_t(width) * height > 1 << 24) throw runtime_error("bad image size");
+    if (!(fov > 0 && fov < 180)) throw runtime_error("bad camera");
+
+    Camera camera(position, width, height, fov);
+    if (aimed) camera.lookAt(target);
+    return SceneDescription{ std::move(scene), camera };
+}
+
+// protocol lines and whole scene descriptions are bounded, a peer that never ends them is dropped
+constexpr size_t MAX_LINE = 64 << 10;
+constexpr size_t MAX_DESCRIPTION = 64 << 20;
+
+// false when the peer closes the connection or sends more than MAX_LINE bytes without a newline
+bool readLine(int fd, string &buffered, string &line) {
+    size_t end;
+    while ((end = buffered.find('\n')) == string::npos) {
+        if (buffered.size() > MAX_LINE) return false;
+        char chunk[4096];
+        ssize_t n = recv(fd, chunk, sizeof(chunk), 0);
+        if (n <= 0) return false;
+        buffered.append(chunk, n);
+    }
+    line = buffered.substr(0, end);
+    buffered.erase(0, end + 1);
+    return true;
+}
+
+bool writeAll(int fd, string_view data) {
+    while (!data.empty()) {
+        ssize_t n = send(fd, data.data(), data.size(), MSG_NOSIGNAL);
+        if (n <= 0) return false;
+        data.remove_prefix(n);
+    }
+    return true;
+}
+
+int connectUnix(const string &path, bool listening) {
+    sockaddr_un address{};
+    address.sun_family = AF_UNIX;
+    if (path.size() >= sizeof(address.sun_path)) throw runtime_error("socket path too long: " + path);
+    path.copy(address.sun_path, path.size());
+
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0) throw runtime_error("cannot create socket");
+    if (listening) unlink(path.c_str());
+    if (listening ? bind(fd, (sockaddr*)&address, sizeof(address)) < 0 || listen(fd, 64) < 0 : connect(fd, (sockaddr*)&address, sizeof(address)) < 0) {
+        close(fd);
+        throw runtime_error("cannot " + string(listening ? "listen on " : "connect to ") + path);
+    }
+    return fd;
+}
+
+class RenderServer {
+public:
+    // mesh lines may only name OBJ files below meshDir, an empty meshDir refuses them
+    RenderServer(unsigned threads, size_t cachedScenes, size_t cachedMeshes, const string &meshDir, bool pinned = false) :
+                 pool(threads, pinned), meshDir(meshDir.empty() ? filesystem::path() : filesystem::canonical(meshDir)),
+                 meshes{ cachedMeshes }, scenes{ cachedScenes } {}
+
+    // accepts connections forever, one thread each, requests render on the dispatcher thread
+    [[noreturn]] void serve(const string &path) {
+        int listener = connectUnix(path, true);
+        thread(&RenderServer::dispatch, this).detach();
+        cout << "serving on " << path << " with " << pool.size() << " threads" << endl;
+        while (true) {
+            int fd = accept(listener, nullptr, nullptr);
+            if (fd >= 0) thread(&RenderServer::handle, this, fd).detach();
+        }
+    }
+
+private:
+    struct Job {
+        uint64_t id;
+        int priority;
+        optional<SceneDescription> description;
+        FrameStatistics frame;
+        double estimate = 0;
+        atomic<bool> cancelled = false;
+        bool done = false;
+        string reply;
+    };
+
+    struct Stats {
+        size_t requests = 0, rendered = 0, cancelled = 0, failed = 0;
+        size_t sceneHits = 0, sceneMisses = 0, meshHits = 0, meshMisses = 0;
+        double estimatedSeconds = 0, renderedSeconds = 0; // of completed renders
+    };
+
+    // least recently used entries are dropped past capacity
+    template <typename Value>
+    struct LruCache {
+        size_t capacity;
+        map<uint64_t, pair<Value, list<uint64_t>::iterator>> entries = {};
+        list<uint64_t> recent = {};
+
+        Value* find(uint64_t key) {
+            auto found = entries.find(key);
+            if (found == entries.end()) return nullptr;
+            recent.splice(recent.begin(), recent, found->second.second);
+            return &found->second.first;
+        }
+
+        // a lookup that leaves the eviction order alone
+        const Value* peek(uint64_t key) const {
+            auto found = entries.find(key);
+            return found == entries.end() ? nullptr : &found->second.first;
+        }
+
+        // the key of the entry dropped to make room, if any
+        optional<uint64_t> insert(uint64_t key, Value value) {
+            if (auto found = entries.find(key); found != entries.end()) {
+                found->second.first = std::move(value);
+                recent.splice(recent.begin(), recent, found->second.second);
+                return {};
+            }
+            recent.push_front(key);
+            entries[key] = { std::move(value), recent.begin() };
+            if (entries.size() <= capacity) return {};
+            uint64_t dropped = recent.back();
+            entries.erase(dropped);
+            recent.pop_back();
+            return dropped;
+        }
+    };
+
+    void handle(int fd) {
+        string buffered, line;
+        if (readLine(fd, buffered, line)) {
+            istringstream in(line);
+            string command;
+            in >> command;
+            if (command == "render" || command == "estimate") {
+                auto job = make_shared<Job>();
+                in >> job->priority;
+                string text;
+                bool ended = false;
+                while (!ended && text.size() <= MAX_DESCRIPTION && readLine(fd, buffered, line)) {
+                    if (line == "end") ended = true;
+                    else text += line + '\n';
+                }
+                // a connection dropped or cut off mid-description leaves nobody to answer and nothing complete to render
+                if (!ended) {
+                    close(fd);
+                    return;
+                }
+                try {
+                    parse(*job, text, command == "estimate");
+                    if (command == "estimate") {
+                        string reply;
+                        {
+                            lock_guard lock(guard);
+                            reply = "estimate " + estimateText(model.estimate(job->frame, pool.size())) + ", " + to_string(uint64_t(job->frame.work())) + " work\n";
+                        }
+                        writeAll(fd, reply);
+                    } else {
+                        submit(fd, job);
+                    }
+                } catch (const exception &e) {
+                    if (command == "render") {
+                        lock_guard lock(guard);
+                        stats.requests++;
+                        stats.failed++;
+                    }
+                    writeAll(fd, "error " + string(e.what()) + "\n");
+                }
+            } else if (command == "cancel") {
+                uint64_t id = 0;
+                in >> id;
+                writeAll(fd, cancel(id) ? "ok\n" : "unknown\n");
+            } else if (command == "stats") {
+                string reply;
+                {
+                    lock_guard lock(guard);
+                    reply = "requests " + to_string(stats.requests) + " rendered " + to_string(stats.rendered) + " cancelled " +
+                            to_string(stats.cancelled) + " failed " + to_string(stats.failed) + " scene hits " + to_string(stats.sceneHits) +
+                            " misses " + to_string(stats.sceneMisses) + " mesh hits " + to_string(stats.meshHits) + " misses " +
+                            to_string(stats.meshMisses) + " estimated " + to_string(stats.estimatedSeconds) + " s rendered " +
+                            to_string(stats.renderedSeconds) + " s\n";
+                }
+                writeAll(fd, reply);
+            } else {
+                writeAll(fd, "error unknown command\n");
+            }
+        }
+        close(fd);
+    }
+
+    // scenes are parsed on the connection's thread, so the cost of a job is known before it is queued.
+    // A query (the estimate command) leaves the mesh cache and its counters untouched.
+    void parse(Job &job, const string &text, bool query) {
+        job.description = parseSceneDescription(text, [this, query](const string &file, const vec3 &offset, float scale, const vec3 &color) {
+            return loadMesh(file, offset, scale, color, query);
+        });
+        const SceneDescription &description = *job.description;
+        job.frame = frameStatistics(description.scene, description.camera);
+    }
+
+    // "unknown" until the first rendered scene has calibrated the model
+    string estimateText(double estimate) const { return model.calibrated() ? to_string(estimate) + " s" : "unknown"; }
+
+    // the reply carries the job's own estimate and the time until it should be done: the rest of the
+    // running job plus everything queued that dispatches first
+    void submit(int fd, const shared_ptr<Job> &job) {
+        unique_lock lock(guard);
+        job->id = ++lastId;
+        job->estimate = model.estimate(job->frame, pool.size());
+        stats.requests++;
+        double eta = job->estimate;
+        if (running) eta += max(0.0, running->estimate - chrono::duration<double>(chrono::steady_clock::now() - runningSince).count());
+        for (const shared_ptr<Job> &queued : queue) {
+            if (queued->priority >= job->priority) eta += queued->estimate;
+        }
+        jobs[job->id] = job;
+        queue.push_back(job);
+        queueChanged.notify_one();
+
+        string reply = "id " + to_string(job->id) + " estimate " + estimateText(job->estimate) + " eta " + estimateText(eta) + "\n";
+        lock.unlock();
+        writeAll(fd, reply);
+
+        // a closed connection reads as end of file, the job is no longer wanted
+        lock.lock();
+        while (!finished.wait_for(lock, chrono::milliseconds(100), [&] { return job->done; })) {
+            char probe;
+            if (recv(fd, &probe, 1, MSG_PEEK | MSG_DONTWAIT) == 0) cancelLocked(job->id);
+        }
+        jobs.erase(job->id);
+        lock.unlock();
+        writeAll(fd, job->reply);
+    }
+
+    bool cancel(uint64_t id) {
+        lock_guard lock(guard);
+        return cancelLocked(id);
+    }
+
+    bool cancelLocked(uint64_t id) {
+        auto found = jobs.find(id);
+        if (found == jobs.end() || found->second->done) return false;
+        Job &job = *found->second;
+        job.cancelled = true;
+        auto queued = find(queue.begin(), queue.end(), found->second);
+        if (queued != queue.end()) {
+            queue.erase(queued);
+            finish(job, "cancelled\n");
+            stats.cancelled++;
+        }
+        return true;
+    }
+
+    void finish(Job &job, string reply) {
+        job.reply = std::move(reply);
+        job.done = true;
+        finished.notify_all();
+    }
+
+    void dispatch() {
+        while (true) {
+            unique_lock lock(guard);
+            queueChanged.wait(lock, [this] { return !queue.empty(); });
+            auto next = min_element(queue.begin(), queue.end(), [](const shared_ptr<Job> &a, const shared_ptr<Job> &b) {
+                return a->priority != b->priority ? a->priority > b->priority : a->id < b->id;
+            });
+            shared_ptr<Job> job = *next;
+            queue.erase(next);
+            running = job;
+            runningSince = chrono::steady_clock::now();
+            lock.unlock();
+
+            string reply;
+            size_t Stats::*outcome = &Stats::rendered;
+            try {
+                reply = render(*job);
+                if (job->cancelled) reply = "cancelled\n", outcome = &Stats::cancelled;
+            } catch (const exception &e) {
+                reply = "error " + string(e.what()) + "\n", outcome = &Stats::failed;
+            }
+            double seconds = chrono::duration<double>(chrono::steady_clock::now() - runningSince).count();
+
+            lock.lock();
+            running.reset();
+            stats.*outcome += 1;
+            if (outcome == &Stats::rendered) {
+                stats.estimatedSeconds += job->estimate;
+                stats.renderedSeconds += seconds;
+                model.observe(job->frame, pool.size(), seconds);
+            }
+            finish(*job, std::move(reply));
+        }
+    }
+
+    // errors only echo the name the client sent, never where the server looked
+    string readMesh(const string &file) const {
+        if (meshDir.empty()) throw runtime_error("mesh files are disabled on this server");
+        filesystem::path requested(file);
+        // symlinks and ".." are resolved before the prefix check
+        filesystem::path resolved = filesystem::weakly_canonical(meshDir / requested);
+        if (requested.is_absolute() || mismatch(meshDir.begin(), meshDir.end(), resolved.begin(), resolved.end()).first != meshDir.end())
+            throw runtime_error("mesh " + file + " is outside the mesh directory");
+        try {
+            return readFile(resolved);
+        } catch (const exception &) {
+            throw runtime_error("cannot read mesh " + file);
+        }
+    }
+
+    RuntimeMesh loadMesh(const string &file, const vec3 &offset, float scale, const vec3 &color, bool query) {
+        string src = readMesh(file);
+        uint64_t key = ContentHash().add(src.data(), src.size()).add(&offset, sizeof(offset)).add(&scale, sizeof(scale)).add(&color, sizeof(color)).value;
+        if (query) {
+            {
+                lock_guard lock(guard);
+                if (const RuntimeMesh* found = meshes.peek(key)) return *found;
+            }
+            return buildObjMesh(src, offset, scale, color, Diffuse);
+        }
+        {
+            lock_guard lock(guard);
+            if (RuntimeMesh* found = meshes.find(key)) {
+                stats.meshHits++;
+                return *found;
+            }
+            stats.meshMisses++;
+        }
+        // built without the lock so a large upload does not stall the other connections;
+        // a connection that built the same mesh meanwhile wins and this copy is dropped
+        RuntimeMesh mesh = buildObjMesh(src, offset, scale, color, Diffuse);
+        lock_guard lock(guard);
+        if (RuntimeMesh* found = meshes.find(key)) return *found;
+        // cached scenes keep their own references, dropping a mesh here only costs a rebuild
+        meshes.insert(key, mesh);
+        return mesh;
+    }
+
+    string render(Job &job) {
+        const SceneDescription &description = *job.description;
+        const Camera &camera = description.camera;
+        uint64_t sceneHash = hashScene(description.scene);
+        uint64_t key = ContentHash().field(sceneHash).field(camera).value;
+        shared_ptr<const PreparedScene> prepared = cachedScene(key, description.scene, camera);
+        if (!calibrated) calibrate(job, *prepared);
+
+        // the last render of a cached scene schedules the next one
+        TileCosts heatmap;
+        {
+            lock_guard lock(guard);
+            auto found = heatmaps.find(key);
+            if (found != heatmaps.end()) heatmap = found->second;
+        }
+        string image = encodeP6(renderViews(*prepared, span<const Camera>(&camera, 1), pool, &job.cancelled, &heatmap)[0]);
+        {
+            lock_guard lock(guard);
+            if (scenes.entries.count(key)) heatmaps[key] = std::move(heatmap);
+        }
+        return "image " + to_string(image.size()) + "\n" + image;
+    }
+
+    // the first scene to render calibrates the cost model for all later ones, on the dispatcher
+    // from the scene it prepared anyway; jobs already queued get their estimates now
+    void calibrate(Job &job, const PreparedScene &prepared) {
+        CostModel probed;
+        probed.calibrate(prepared, job.description->camera, pool);
+        lock_guard lock(guard);
+        model = probed;
+        calibrated = true;
+        job.estimate = model.estimate(job.frame, pool.size());
+        for (const shared_ptr<Job> &queued : queue) queued->estimate = model.estimate(queued->frame, pool.size());
+        runningSince = chrono::steady_clock::now(); // the render is measured without the probe
+    }
+
+    // least recently used prepared scenes are dropped past --scene-cache entries
+    shared_ptr<const PreparedScene> cachedScene(uint64_t key, const RuntimeScene &scene, const Camera &camera) {
+        {
+            lock_guard lock(guard);
+            if (shared_ptr<const PreparedScene>* found = scenes.find(key)) {
+                stats.sceneHits++;
+                return *found;
+            }
+            stats.sceneMisses++;
+        }
+        auto prepared = make_shared<PreparedScene>(scene, camera);
+        replicatePerNode(*prepared, pool);
+        lock_guard lock(guard);
+        if (optional<uint64_t> dropped = scenes.insert(key, prepared)) heatmaps.erase(*dropped);
+        return prepared;
+    }
+
+    ThreadPool pool;
+    filesystem::path meshDir;
+    mutex guard;
+    condition_variable queueChanged, finished;
+    map<uint64_t, shared_ptr<Job>> jobs;
+    vector<shared_ptr<Job>> queue;
+    uint64_t lastId = 0;
+    LruCache<RuntimeMesh> meshes;
+    LruCache<shared_ptr<const PreparedScene>> scenes;
+    map<uint64_t, TileCosts> heatmaps;
+    Stats stats;
+    CostModel model;
+    bool calibrated = false; // only touched by the dispatcher
+    shared_ptr<Job> running;
+    chrono::steady_clock::time_point runningSince;
+};
+
+// sends one scene file to a running server and writes the image it returns to Picture.ppm
+int submitRequest(const string &socketPath, const string &sceneFile, int priority) {
+    int fd = connectUnix(socketPath, false);
+    writeAll(fd, "render " + to_string(priority) + "\n" + readFile(sceneFile) + "\nend\n");
+
+    // a rejected request gets a single "error" line instead of its id
+    string buffered, line;
+    bool queued = readLine(fd, buffered, line) && line.rfind("id ", 0) == 0;
+    cout << (line.empty() ? "connection closed" : line) << endl;
+    if (!queued) {
+        close(fd);
+        return 1;
+    }
+    line.clear();
+    if (!readLine(fd, buffered, line) || line.rfind("image ", 0) != 0) {
+        cout << (line.empty() ? "connection closed" : line) << endl;
+        close(fd);
+        return 1;
+    }
+    size_t bytes = stoul(line.substr(6));
+    while (buffered.size() < bytes) {
+        char chunk[65536];
+        ssize_t n = recv(fd, chunk, sizeof(chunk), 0);
+        if (n <= 0) break;
+        buffered.append(chunk, n);
+    }
+    close(fd);
+    ofstream("Picture.ppm", ios::out | ios::binary) << buffered;
+    cout << "received " << buffered.size() << " bytes" << endl;
+    return buffered.size() == bytes ? 0 : 1;
+}
+
+// asks a running server what a scene file would cost, without rendering it
+int estimateRequest(const string &socketPath, const string &sceneFile) {
+    int fd = connectUnix(socketPath, false);
+    writeAll(fd, "estimate 0\n" + readFile(sceneFile) + "\nend\n");
+
+    string buffered, line;
+    bool answered = readLine(fd, buffered, line);
+    close(fd);
+    cout << (answered ? line : "connection closed") << endl;
+    return answered && line.rfind("estimate ", 0) == 0 ? 0 : 1;
+}
+
+// errors of the runtime modes (bad input files, failed writes) end the process with a message
+int main(int argc, char** argv) try {
+
+                                                //center, radius, color, material
+    static constexpr array<Sphere, 5> spheres = {Sphere(vec3(0.0, -10004, -20), 10000, vec3(0.20, 0.20, 0.25), Diffuse), 
+                                                 Sphere(vec3(2.0, -2.5, -25), 1.5, vec3(1.0, 0.75, 0.45), Diffuse),
+                                                 Sphere(vec3(-5, -1, -35), 3, vec3(0.75, 0.45, 0.45), Diffuse),
+                                                 Sphere(vec3(5.0, 1, -45), 5, vec3(0.45, 0.45, 0.75), Diffuse),
+                                                 Sphere(vec3(-6.0, 9, -20), 1.5, vec3(0.75, 0.75, 0.75), Diffuse) // above the frame, shadow only
+    };
+                                                //source, offset, scale, color, material
+    static constexpr array<Mesh<objTriangleCount(octahedronObj)>, 1> meshes = {
+        loadObj<objTriangleCount(octahedronObj)>(octahedronObj, vec3(-1.5, -2.6, -22), 1.2, vec3(0.45, 0.75, 0.45), Diffuse)
+    };
+                                                //nodes (shape, op, center, size, blend), bounds, lipschitz
+    static constexpr array<SdfPrimitive, 1> sdfs = {
+        SdfPrimitive({ SdfNode{ SdfSphere, SdfUnion, vec3(-1.6, 2.4, -32), vec3(0.9) },
+                       SdfNode{ SdfSphere, SdfSmoothUnion, vec3(-0.4, 2.8, -32), vec3(0.7), 0.8 },
+                       SdfNode{ SdfTorus, SdfSmoothUnion, vec3(-1, 1.9, -32), vec3(1.1, 0.25, 0), 0.5 } },
+                     Sphere(vec3(-1, 2.4, -32), 2.2, vec3(0.85, 0.85, 0.55), Diffuse))
+    };
+                                                //pos, color, intensity
+    static constexpr array<Light, 1> lights = {Light(vec3(-10.0, 20, -10), vec3(1, 1, 1), 1.0)};
+
+    static constexpr vec3 background = { 0, 0, 0 }; //black background
+
+    static constexpr Scene scene = { spheres, meshes, sdfs, lights, background };
+
+    static constexpr float fov = 30;
+    static constexpr Camera camera(vec3(0), WIDTH, HEIGHT, fov);
+
+    static constexpr auto primaryScene = cullScene<cullCounts(scene, camera, PrimaryRays)>(scene, camera, PrimaryRays);
+    static constexpr auto shadowScene = cullScene<cullCounts(scene, camera, ShadowRays)>(scene, camera, ShadowRays);
+    static constexpr auto cones = viewCones(primaryScene.spheres, camera.position);
+    static constexpr auto lightCones = occluderCones(shadowScene.lights, shadowScene.spheres);
+    static constexpr FrameContext frame = { .viewCones = cones, .occluderCones = lightCones };
+
+    // runtime modes: --obj <file> adds a mesh imported at runtime, --bench <frames> times the runtime renderer,
+    // --build-treelets <spheres.txt> <out> and --treelets <file> [--resident-mb <n>] [--bench <frames>] stream out-of-core sphere scenes,
+    // --shadow-map <resolution> [--shadow-bias <b>] [--pcf <radius>] replaces shadow rays, --shadow-compare 1 also traces them and reports the error,
+    // --indirect <samples> [--irradiance-accuracy <a>] [--irradiance-cache <file>] adds cached indirect diffuse light,
+    // --ao <samples> [--ao-distance <d>] renders ambient occlusion to AmbientOcclusion.ppm,
+    // --aperture <radius> --focus <distance> [--lens-samples <n>] renders thin-lens depth of field,
+    // --views <n> [--threads <t>] renders a turntable of n views to View<i>.ppm in one job,
+    // --equirect <width> renders a panorama to Panorama.ppm, --cubemap <resolution> six faces to Cube<face>.ppm,
+    // --serve <socket> [--scene-cache <n>] [--mesh-cache <n>] [--mesh-dir <dir>] runs the render daemon, --submit <scene file> --socket <path> [--priority <p>] calls it,
+    // --estimate <scene file> --socket <path> asks it for the render time of a scene,
+    // --render-cache <dir> [--render-cache-mb <n>] reuses runtime frames rendered before,
+    // --farm <workers> renders in forked worker processes sharing a framebuffer (RT_FARM_KILL=<slot> crashes one, for testing),
+    // --tiles x0,y0,x1,y1 [--tile-out <file>] renders part of the frame, --merge <out.ppm|out.png> <tiles...> joins the parts,
+    // --progressive <samples> [--checkpoint <file>] [--checkpoint-seconds <s>] accumulates jittered samples and resumes from the checkpoint,
+    // --reproducible 1 makes the runtime frame independent of --threads (it always is without --indirect),
+    // --trace-out <file> writes a Chrome trace of the runtime render in builds with -DRT_INSTRUMENT=1,
+    // --perf 1 reports hardware counters per stage of --bench or of the runtime render,
+    // --eta 1 predicts the runtime or progressive render time from a sparse probe before rendering,
+    // --pin 1 pins pool threads across NUMA nodes with per-node scene replicas, --scaling <frames> benchmarks both pools,
+    // --huge-pages system|off|thp|explicit backs framebuffers, BVHs and SoA arrays, --huge-bench <frames> compares the modes
+    string objFile, treeletFile;
+    int benchFrames = 0;
+    size_t residentMB = 256;
+    ShadowMapSettings shadowMapSettings{ 0 };
+    bool shadowCompare = false;
+    IrradianceSettings irradianceSettings{ 0 };
+    string irradianceFile;
+    AmbientOcclusionSettings aoSettings{ 0 };
+    DepthOfFieldSettings dofSettings;
+    Camera runtimeCamera = camera;
+    int viewCount = 0, equirectWidth = 0, cubemapResolution = 0;
+    string serveSocket, submitFile, estimateFile, socketPath;
+    size_t cachedScenes = 16, cachedMeshes = 16;
+    string meshDir;
+    int priority = 0;
+    string renderCacheDir;
+    size_t renderCacheMB = 256;
+    int farmWorkers = 0;
+    optional<TileFileHeader> tileRect;
+    string tileFile;
+    int progressiveSamples = 0;
+    string checkpointFile;
+    double checkpointSeconds = 60;
+    bool reproducible = false;
+    string traceFile;
+    bool countEvents = false;
+    bool printEta = false;
+    bool pinThreads = false;
+    int scalingFrames = 0;
+    int hugeBenchFrames = 0;
+    unsigned threads = thread::hardware_concurrency();
+    bool threadsSet = false;
+    for (int i = 1; i + 1 < argc; i += 2) {
+        string arg = argv[i];
+        if (arg == "--obj") objFile = argv[i + 1];
+        else if (arg == "--bench") benchFrames = stoi(argv[i + 1]);
+        else if (arg == "--treelets") treeletFile = argv[i + 1];
+        else if (arg == "--resident-mb") residentMB = stoul(argv[i + 1]);
+        else if (arg == "--shadow-map") shadowMapSettings.resolution = stoi(argv[i + 1]);
+        else if (arg == "--shadow-bias") shadowMapSettings.bias = stof(argv[i + 1]);
+        else if (arg == "--pcf") shadowMapSettings.pcfRadius = stoi(argv[i + 1]);
+        else if (arg == "--shadow-compare") shadowCompare = stoi(argv[i + 1]) != 0;
+        else if (arg == "--indirect") irradianceSettings.samples = stoi(argv[i + 1]);
+        else if (arg == "--irradiance-accuracy") irradianceSettings.accuracy = stof(argv[i + 1]);
+        else if (arg == "--irradiance-cache") irradianceFile = argv[i + 1];
+        else if (arg == "--ao") aoSettings.samples = stoi(argv[i + 1]);
+        else if (arg == "--ao-distance") aoSettings.maxDistance = stof(argv[i + 1]);
+        else if (arg == "--aperture") runtimeCamera.aperture = stof(argv[i + 1]);
+        else if (arg == "--focus") runtimeCamera.focusDistance = stof(argv[i + 1]);
+        else if (arg == "--lens-samples") dofSettings.lensSamples = stoi(argv[i + 1]);
+        else if (arg == "--views") viewCount = stoi(argv[i + 1]);
+        else if (arg == "--threads") threads = stoul(argv[i + 1]), threadsSet = true;
+        else if (arg == "--equirect") equirectWidth = stoi(argv[i + 1]);
+        else if (arg == "--cubemap") cubemapResolution = stoi(argv[i + 1]);
+        else if (arg == "--serve") serveSocket = argv[i + 1];
+        else if (arg == "--scene-cache") cachedScenes = stoul(argv[i + 1]);
+        else if (arg == "--mesh-cache") cachedMeshes = stoul(argv[i + 1]);
+        else if (arg == "--mesh-dir") meshDir = argv[i + 1];
+        else if (arg == "--submit") submitFile = argv[i + 1];
+        else if (arg == "--socket") socketPath = argv[i + 1];
+        else if (arg == "--priority") priority = stoi(argv[i + 1]);
+        else if (arg == "--render-cache") renderCacheDir = argv[i + 1];
+        else if (arg == "--render-cache-mb") renderCacheMB = stoul(argv[i + 1]);
+        else if (arg == "--farm") farmWorkers = stoi(argv[i + 1]);
+        else if (arg == "--tiles") {
+            TileFileHeader rect{};
+            if (sscanf(argv[i + 1], "%u,%u,%u,%u", &rect.x0, &rect.y0, &rect.x1, &rect.y1) != 4) throw runtime_error("--tiles expects x0,y0,x1,y1");
+            tileRect = rect;
+        }
+        else if (arg == "--tile-out") tileFile = argv[i + 1];
+        else if (arg == "--progressive") progressiveSamples = stoi(argv[i + 1]);
+        else if (arg == "--checkpoint") checkpointFile = argv[i + 1];
+        else if (arg == "--checkpoint-seconds") checkpointSeconds = stod(argv[i + 1]);
+        else if (arg == "--reproducible") reproducible = stoi(argv[i + 1]) != 0;
+        else if (arg == "--trace-out") traceFile = argv[i + 1];
+        else if (arg == "--perf") countEvents = stoi(argv[i + 1]) != 0;
+        else if (arg == "--eta") printEta = stoi(argv[i + 1]) != 0;
+        else if (arg == "--estimate") estimateFile = argv[i + 1];
+        else if (arg == "--pin") pinThreads = stoi(argv[i + 1]) != 0;
+        else if (arg == "--scaling") scalingFrames = stoi(argv[i + 1]);
+        else if (arg == "--huge-bench") hugeBenchFrames = stoi(argv[i + 1]);
+        else if (arg == "--huge-pages") {
+            const map<string, PageMode> modes = { { "system", PageMode::System }, { "off", PageMode::Small },
+                                                  { "thp", PageMode::Transparent }, { "explicit", PageMode::Explicit } };
+            auto found = modes.find(argv[i + 1]);
+            if (found == modes.end()) throw runtime_error("--huge-pages expects system, off, thp or explicit");
+            HugePages::mode = found->second;
+        }
+        else if (arg == "--merge") return mergeTiles(argv[i + 1], span<char* const>(argv + i + 2, argc - i - 2));
+        else if (arg == "--build-treelets" && i + 2 < argc) {
+            buildTreelets(argv[i + 1], argv[i + 2]);
+            return 0;
+        }
+    }
+
+    // the circle of confusion is measured in pixels on the focus plane, which needs one in front of the camera
+    if (runtimeCamera.aperture > 0 && !(runtimeCamera.focusDistance > 0)) throw runtime_error("--focus must be positive with --aperture");
+
+    // a cache hit skips the render these report on
+    if (!renderCacheDir.empty() && (shadowCompare || countEvents || printEta))
+        throw runtime_error("--render-cache cannot be combined with --shadow-compare, --perf or --eta");
+
+    // forked workers would each warm their own irradiance cache and draw tiles with the pinhole camera,
+    // so the frame would silently differ from the single-process render
+    if (farmWorkers > 0 && (irradianceSettings.samples > 0 || !irradianceFile.empty() || runtimeCamera.aperture > 0))
+        throw runtime_error("--farm cannot be combined with --indirect, --irradiance-cache or --aperture");
+
+    // each tile process would warm its own irradiance cache and draw with the pinhole camera, so merged tiles would not reproduce the frame
+    if (tileRect && (irradianceSettings.samples > 0 || !irradianceFile.empty() || runtimeCamera.aperture > 0))
+        throw runtime_error("--tiles cannot be combined with --indirect, --irradiance-cache or --aperture");
+
+    // progressive passes shade direct light only, and a checkpoint could not capture a warming irradiance cache
+    if (progressiveSamples > 0 && (irradianceSettings.samples > 0 || !irradianceFile.empty()))
+        throw runtime_error("--progressive cannot be combined with --indirect or --irradiance-cache");
+
+    if (!serveSocket.empty()) RenderServer(threads, cachedScenes, cachedMeshes, meshDir, pinThreads).serve(serveSocket);
+    if (!submitFile.empty()) return submitRequest(socketPath, submitFile, priority);
+    if (!estimateFile.empty()) return estimateRequest(socketPath, estimateFile);
+
+    auto exportTrace = [&] {
+        if (traceFile.empty()) return;
+        if (!Instrument::enabled) {
+            cout << "--trace-out needs a build with -DRT_INSTRUMENT=1" << endl;
+        } else {
+            Instrument::printTotals();
+            if (Instrument::chromeTrace(traceFile)) cout << "trace written to " << traceFile << endl;
+        }
+    };
+
+    if (!treeletFile.empty()) {
+        TreeletScene streamed(treeletFile, residentMB << 20);
+        save("Picture.ppm", renderOutOfCore(streamed, lights, background, camera));
+        const StreamStats &stats = streamed.stats;
+        cout << "treelets: " << streamed.treeletCount() << ", loads: " << stats.treeletLoads << ", paged: " << (stats.bytesPaged >> 10)
+             << " KiB, peak resident: " << (stats.peakResidentBytes >> 10) << " KiB, rays queued: " << stats.raysQueued << endl;
+        cout << "arena " << (Arena::local().reserved() >> 10) << " KiB, ray packets " << FixedPool<RayPacket>::local().capacity() << " pooled" << endl;
+        if (benchFrames > 0) {
+            // the first frame grew the arena and the packet pool, these run on what it left behind
+            Instrument::Totals before = Instrument::totals();
+            auto start = chrono::steady_clock::now();
+            for (int frame = 0; frame < benchFrames; ++frame) renderOutOfCore(streamed, lights, background, camera);
+            chrono::duration<double, milli> elapsed = chrono::steady_clock::now() - start;
+            cout << benchFrames << " more frames: " << elapsed.count() / benchFrames << " ms per frame" << endl;
+            if (!Instrument::enabled) cout << "allocation counts per stage need a build with -DRT_INSTRUMENT=1" << endl;
+            for (const auto &[stage, total] : Instrument::totals()) {
+                cout << "  " << stage << ": " << double(total[2] - before[stage][2]) / benchFrames << " allocations per frame" << endl;
+            }
+        }
+        exportTrace();
+        return 0;
+    }
+
+    // any runtime option selects the runtime renderer, --threads and --reproducible on their own render the default frame with it
+    if (!objFile.empty() || benchFrames > 0 || shadowMapSettings.resolution > 0 || irradianceSettings.samples > 0 || aoSettings.samples > 0 ||
+        runtimeCamera.aperture > 0 || viewCount > 0 || equirectWidth > 0 || cubemapResolution > 0 || threadsSet || reproducible ||
+        !renderCacheDir.empty() || farmWorkers > 0 || tileRect || progressiveSamples > 0 || !traceFile.empty() || countEvents || printEta || pinThreads || scalingFrames > 0 || hugeBenchFrames > 0) {
+        RuntimeScene runtime = toRuntime(scene);
+        if (!objFile.empty()) runtime.meshes.push_back(loadObjFile(objFile, vec3(1.5, 0, -30), 2, vec3(0.75, 0.75, 0.75), Diffuse));
+
+        if (benchFrames > 0) {
+            benchmark(runtime, camera, benchFrames, countEvents);
+        } else if (scalingFrames > 0) {
+            scalingBenchmark(runtime, camera, scalingFrames, max(threads, 1u));
+        } else if (hugeBenchFrames > 0) {
+            hugePageBenchmark(runtime, camera, hugeBenchFrames);
+        } else if (aoSettings.samples > 0) {
+            auto start = chrono::steady_clock::now();
+            save("AmbientOcclusion.ppm", renderAmbientOcclusion(PreparedScene(runtime, camera), camera, aoSettings));
+            cout << "ambient occlusion: " << chrono::duration<double, milli>(chrono::steady_clock::now() - start).count() << " ms" << endl;
+        } else if (progressiveSamples > 0) {
+            auto start = chrono::steady_clock::now();
+            ThreadPool pool(threads);
+            PreparedScene prepared(runtime, runtimeCamera);
+            if (shadowMapSettings.resolution > 0) prepared.buildShadowMaps(shadowMapSettings);
+            uint64_t key = renderKey(runtime, runtimeCamera, shadowMapSettings, IrradianceSettings{ 0 }, true);
+            ProgressiveRenderer progressive(prepared, runtimeCamera, progressiveSamples, key);
+            if (!checkpointFile.empty() && progressive.resume(checkpointFile)) cout << "resumed from " << checkpointFile << endl;
+            if (printEta) {
+                CostModel model;
+                double probe = model.calibrate(prepared, runtimeCamera, pool);
+                double eta = model.estimate(frameStatistics(prepared.primary, prepared.shadow, runtimeCamera, progressiveSamples), pool.size()) * (1 - progressive.completed());
+                cout << "eta " << eta * 1000 << " ms for " << 100 * (1 - progressive.completed()) << "% of the samples on " << pool.size() << " threads (probe "
+                     << probe * 1000 << " ms)" << endl;
+            }
+            progressive.run(pool, checkpointFile, checkpointSeconds);
+            save("Picture.ppm", progressive.image());
+            cout << "progressive: " << progressiveSamples << " samples per pixel in " << chrono::duration<double, milli>(chrono::steady_clock::now() - start).count()
+                 << " ms, " << progressive.checkpointsWritten() << " checkpoints written, " << progressive.checkpointsFailed() << " failed" << endl;
+        } else if (tileRect) {
+            PreparedScene prepared(runtime, camera);
+            if (shadowMapSettings.resolution > 0) prepared.buildShadowMaps(shadowMapSettings);
+            if (tileFile.empty()) tileFile = "Tile_" + to_string(tileRect->x0) + "_" + to_string(tileRect->y0) + ".rtt";
+            renderTileFile(prepared, camera, *tileRect, tileFile);
+        } else if (farmWorkers > 0) {
+            auto start = chrono::steady_clock::now();
+            PreparedScene prepared(runtime, camera);
+            if (shadowMapSettings.resolution > 0) prepared.buildShadowMaps(shadowMapSettings);
+            FarmStats stats;
+            // test hook: the worker in this slot kills itself on its first tile
+            const char* killSlot = getenv("RT_FARM_KILL");
+            save("Picture.ppm", renderTileFarm(prepared, camera, farmWorkers, stats, killSlot ? atoi(killSlot) : -1));
+            cout << "tile farm: " << chrono::duration<double, milli>(chrono::steady_clock::now() - start).count() << " ms, tiles per worker";
+            for (uint32_t tiles : stats.tilesPerSlot) cout << " " << tiles;
+            cout << ", " << stats.reassigned << " tiles reassigned, " << stats.respawned << " workers respawned" << endl;
+        } else if (viewCount > 0) {
+            using clock = chrono::steady_clock;
+            const vec3 target(0, 0, -30); // orbit around the middle of the scene, view 0 is the default camera
+            vector<Camera> cameras;
+            for (int v = 0; v < viewCount; ++v) {
+                float theta = 2 * M_PI * v / viewCount;
+                Camera view(target + vec3(sin(theta), 0, cos(theta)) * 30, WIDTH, HEIGHT, 30);
+                cameras.push_back(view.lookAt(target));
+            }
+
+            auto start = clock::now();
+            ThreadPool pool(threads, pinThreads);
+            PreparedScene prepared(runtime, cameras);
+            if (shadowMapSettings.resolution > 0) prepared.buildShadowMaps(shadowMapSettings);
+            if (irradianceSettings.samples > 0) prepared.enableIrradianceCache(irradianceSettings);
+            replicatePerNode(prepared, pool);
+            auto shared = clock::now();
+            vector<TileCosts> heatmaps(cameras.size());
+            vector<Canvas> canvases = renderViews(prepared, cameras, pool, nullptr, heatmaps.data());
+            auto rendered = clock::now();
+
+            size_t tiles = 0;
+            for (const TileCosts &heatmap : heatmaps) tiles += heatmap.tiles;
+            for (int v = 0; v < viewCount; ++v) save("View" + to_string(v) + ".ppm", canvases[v]);
+            cout << viewCount << " views on " << pool.size() << " threads: shared preprocessing " << chrono::duration<double, milli>(shared - start).count()
+                 << " ms, rendered in " << chrono::duration<double, milli>(rendered - shared).count() << " ms, " << tiles << " tiles, "
+                 << pool.stolen() << " stolen" << endl;
+        } else if (equirectWidth > 0 || cubemapResolution > 0) {
+            using clock = chrono::steady_clock;
+            auto start = clock::now();
+            ThreadPool pool(threads);
+            // the cube faces cover every direction, culling against them keeps what the panorama sees
+            array<Camera, 6> faces = cubeFaceCameras(camera.position, max(cubemapResolution, 1));
+            PreparedScene prepared(runtime, faces);
+            if (shadowMapSettings.resolution > 0) prepared.buildShadowMaps(shadowMapSettings);
+            if (irradianceSettings.samples > 0) prepared.enableIrradianceCache(irradianceSettings);
+
+            if (equirectWidth > 0) {
+                save("Panorama.ppm", renderEquirect(prepared, Camera(camera.position, equirectWidth, equirectWidth / 2, 90), pool));
+            }
+            if (cubemapResolution > 0) {
+                const char* names[6] = { "PosX", "NegX", "PosY", "NegY", "PosZ", "NegZ" };
+                vector<Canvas> canvases = renderViews(prepared, faces, pool);
+                for (int face = 0; face < 6; ++face) save("Cube" + string(names[face]) + ".ppm", canvases[face]);
+            }
+            cout << "panorama on " << pool.size() << " threads: " << chrono::duration<double, milli>(clock::now() - start).count() << " ms" << endl;
+        } else if (runtimeCamera.aperture > 0) {
+            auto start = chrono::steady_clock::now();
+            size_t sampled = 0;
+            PreparedScene prepared(runtime, runtimeCamera);
+            if (shadowMapSettings.resolution > 0) prepared.buildShadowMaps(shadowMapSettings);
+            if (irradianceSettings.samples > 0) {
+                prepared.enableIrradianceCache(irradianceSettings);
+                if (!irradianceFile.empty() && prepared.irradiance->load(irradianceFile)) {
+                    cout << "loaded " << prepared.irradiance->size() << " irradiance records from " << irradianceFile << endl;
+                }
+            }
+            save("Picture.ppm", renderDepthOfField(prepared, runtimeCamera, dofSettings, sampled));
+            size_t pixels = size_t(runtimeCamera.width) * runtimeCamera.height, n2 = dofSettings.lensSamples * dofSettings.lensSamples;
+            cout << "depth of field: " << chrono::duration<double, milli>(chrono::steady_clock::now() - start).count() << " ms, "
+                 << 100.0 * sampled / pixels << "% of pixels lens sampled, " << pixels + sampled * n2 << " camera rays instead of "
+                 << pixels * n2 << endl;
+            if (prepared.irradiance) {
+                cout << "irradiance cache: " << prepared.irradiance->size() << " records, " << prepared.irradiance->hits << " interpolated, "
+                     << prepared.irradiance->misses << " computed" << endl;
+                if (!irradianceFile.empty()) prepared.irradiance->save(irradianceFile);
+            }
+        } else {
+            using clock = chrono::steady_clock;
+            optional<RenderCache> renderCache;
+            uint64_t key = 0;
+            // a loaded irradiance cache file changes the pixels and is rewritten by every render, no key could name the result
+            if (!renderCacheDir.empty() && !irradianceFile.empty() && irradianceSettings.samples > 0) {
+                cout << "render cache skipped: frames using --irradiance-cache are not cached" << endl;
+            } else if (!renderCacheDir.empty()) {
+                renderCache.emplace(renderCacheDir, uintmax_t(renderCacheMB) << 20);
+                key = renderKey(runtime, camera, shadowMapSettings, irradianceSettings, reproducible);
+                if (optional<string> image = renderCache->find(key)) {
+                    writeImage("Picture.ppm", *image);
+                    RenderCache::Stats totals = renderCache->totals();
+                    cout << "render cache hit " << hex << key << dec << " (" << totals.hits << " hits, " << totals.misses << " misses in total)" << endl;
+                    return 0;
+                }
+            }
+
+            // hardware counters per stage, each stage restarts them
+            optional<PerfCounters> counters;
+            vector<pair<string, pair<CounterValues, double>>> stages;
+            auto stage = [&](const char* name) {
+                if (!counters) return;
+                stages.push_back({ name, { counters->stop(), double(WIDTH) * HEIGHT } });
+                counters->start();
+            };
+            if (countEvents) {
+                counters.emplace();
+                if (counters->available()) counters->start();
+                else cout << "hardware counters unavailable (" << counters->unavailableReason() << ")" << endl, counters.reset();
+                if (counters && !counters->missingEvents().empty()) cout << "not counted, read as 0: " << counters->missingEvents() << endl;
+            }
+
+            // pixels only depend on their own rays, tiles may land on any thread
+            ThreadPool pool(threads, pinThreads);
+            span<const Camera> view(&camera, 1);
+            PreparedScene prepared(runtime, camera);
+            // the maps replace shadow rays from the first frame on, unless that frame is the ray traced reference
+            bool compareShadows = shadowMapSettings.resolution > 0 && shadowCompare;
+            double shadowBuild = 0;
+            if (shadowMapSettings.resolution > 0 && !compareShadows) {
+                auto start = clock::now();
+                prepared.buildShadowMaps(shadowMapSettings);
+                shadowBuild = chrono::duration<double, milli>(clock::now() - start).count();
+            }
+            if (irradianceSettings.samples > 0) {
+                prepared.enableIrradianceCache(irradianceSettings);
+                if (!irradianceFile.empty() && prepared.irradiance->load(irradianceFile)) {
+                    cout << "loaded " << prepared.irradiance->size() << " irradiance records from " << irradianceFile << endl;
+                }
+                if (reproducible) prepared.warmIrradianceCache(camera);
+            }
+            replicatePerNode(prepared, pool);
+            if (printEta) {
+                CostModel model;
+                double probe = model.calibrate(prepared, camera, pool);
+                double eta = model.estimate(frameStatistics(prepared.primary, prepared.shadow, camera), pool.size());
+                cout << "eta " << eta * 1000 << " ms on " << pool.size() << " threads (probe " << probe * 1000 << " ms)" << endl;
+            }
+            stage("prepare");
+            auto traced = clock::now();
+            TileCosts heatmap;
+            Canvas canvas = std::move(renderViews(prepared, view, pool, nullptr, &heatmap)[0]);
+            stage("render");
+            if (printEta) cout << "rendered in " << chrono::duration<double, milli>(clock::now() - traced).count() << " ms" << endl;
+            if (shadowMapSettings.resolution > 0 && !compareShadows) {
+                cout << "shadow maps " << shadowMapSettings.resolution << "^2 x 6, bias " << shadowMapSettings.bias << ", pcf " << shadowMapSettings.pcfRadius
+                     << ": built in " << shadowBuild << " ms, rendered in " << chrono::duration<double, milli>(clock::now() - traced).count() << " ms" << endl;
+            }
+
+            if (compareShadows) {
+                auto start = clock::now();
+                prepared.buildShadowMaps(shadowMapSettings);
+                replicatePerNode(prepared, pool);
+                auto built = clock::now();
+                Canvas mapped = std::move(renderViews(prepared, view, pool, nullptr, &heatmap)[0]);
+                auto rendered = clock::now();
+
+                ImageDifference diff = compareImages(mapped, canvas);
+                cout << "shadow maps " << shadowMapSettings.resolution << "^2 x 6, bias " << shadowMapSettings.bias << ", pcf " << shadowMapSettings.pcfRadius
+                     << ": built in " << chrono::duration<double, milli>(built - start).count() << " ms, rendered in "
+                     << chrono::duration<double, milli>(rendered - built).count() << " ms" << endl;
+                cout << "vs ray traced shadows (" << chrono::duration<double, milli>(start - traced).count() << " ms): rmse " << diff.rmse << ", max error " << diff.maxError << ", "
+                     << diff.differingPixels * 100 << "% of pixels differ" << endl;
+                canvas = std::move(mapped);
+            }
+            if (prepared.irradiance) {
+                IrradianceCache &cache = *prepared.irradiance;
+                cout << "irradiance cache: " << cache.size() << " records, " << cache.hits << " interpolated, " << cache.misses
+                     << " computed, " << chrono::duration<double, milli>(clock::now() - traced).count() << " ms" << endl;
+                if (!irradianceFile.empty()) cache.save(irradianceFile);
+            }
+            if (counters) counters->start();
+            if (renderCache) {
+                string image = encodeP6(canvas);
+                writeImage("Picture.ppm", image);
+                bool stored = renderCache->store(key, image);
+                RenderCache::Stats totals = renderCache->totals();
+                cout << "render cache miss " << hex << key << dec << (stored ? ", stored; " : ", not stored; ") << (renderCache->statistics().bytes >> 10) << " KiB cached, "
+                     << renderCache->statistics().evictions << " evicted (" << totals.hits << " hits, " << totals.misses << " misses in total)" << endl;
+            } else {
+                save("Picture.ppm", canvas);
+            }
+            stage("write");
+            if (counters) {
+                if (pool.size() > 1) cout << "hardware counters cover the calling thread only, use --threads 1 for whole stages" << endl;
+                printCounters(stages);
+            }
+        }
+        exportTrace();
+        return 0;
+    }
+
+    static constexpr FixedCanvas<WIDTH, HEIGHT> image = []{
+        FixedCanvas<WIDTH, HEIGHT> canvas;
+        render(primaryScene, shadowScene, frame, camera, canvas);
         return canvas;
     }();
     
     save("Picture.ppm", image);
 
     return 0;
+} catch (const exception &e) {
+    cerr << e.what() << endl;
+    return 1;
 }